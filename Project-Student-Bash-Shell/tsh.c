@@ -2,7 +2,10 @@
  * tsh - A tiny shell program with job control
  *  
  */
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
@@ -10,13 +13,88 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/pidfd.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <linux/mempolicy.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <limits.h>
+#ifdef USE_SPAWN
+#include <spawn.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86                  /* SSE2/AVX2 scanners, picked at run time */
+#endif
 
 /* Misc manifest constants */
-#define MAXLINE    1024   /* max line size */
-#define MAXARGS     128   /* max args on a command line */
-#define MAXJOBS      16   /* max jobs at any point in time */
+#define MAXLINE    1024   /* max size of a message composed in a fixed buffer */
+#define ARENACHUNK 4096   /* initial size of the command arena (it grows on demand) */
+#define INITJOBS     16   /* initial size of the job list (it grows on demand) */
+#define MAXEVENTS    64   /* max pidfd events handled per epoll wakeup */
+#define MAXQUEUED   256   /* child events collected before they must be applied */
+#define MSGSIZE    4096   /* job messages coalesced into a single write */
+#define INBUFSIZE 65536   /* initial command input buffer (script input is read in blocks this big) */
+#define OUTBUFSIZE 65536  /* stdout buffer in script mode */
+#define CACHESIZE    64   /* command lines kept compiled by the plan cache */
+#define CACHEBUCKETS 128  /* hash buckets of the plan cache (a power of 2) */
+#define CACHEMAXLINE 16384 /* longer command lines are compiled but not cached */
+#define JIDBITS (8 * (int)sizeof(unsigned long)) /* JIDs per word of the JID bitmap */
+#define MAXNODES   1024   /* NUMA nodes that run --mem-node can name */
+
+/* epoll tags of the event sources that are not job processes (PIDs are > 0) */
+#define EV_SIGNALS 0              /* the signalfd */
+#define EV_INPUT   ((uint64_t)-1) /* the command input */
+
+#ifndef PIDFD_SIGNAL_PROCESS_GROUP
+#define PIDFD_SIGNAL_PROCESS_GROUP (1UL << 2) /* Linux 6.9+, not yet in every libc */
+#endif
+#ifndef CLONE_INTO_CGROUP
+#define CLONE_INTO_CGROUP 0x200000000ULL  /* Linux 5.7+, not yet in every libc */
+#endif
+
+struct cloneargs_t {        /* struct clone_args of clone3(2), which libc does not wrap */
+    uint64_t flags, pidfd, child_tid, parent_tid, exit_signal;
+    uint64_t stack, stack_size, tls, set_tid, set_tid_size, cgroup;
+};
+
+/*
+ * Launch backend: by default every job is started with fork(). Build with
+ * -DUSE_SPAWN to start external commands with posix_spawn instead, except
+ * for the jobs of "run" with a placement, limits or a cgroup, which still
+ * need a forked child to set them up (see startstage).
+ *
+ * Build with -DSCANBENCH to get a microbenchmark of the command-line
+ * parser instead of the shell (see scanbench).
+ */
+
+/* Token kinds (the shell operators are recognized while tokenizing) */
+#define TK_WORD 0 /* an ordinary word */
+#define TK_PIPE 1 /* | */
+#define TK_IN   2 /* < */
+#define TK_OUT  3 /* > */
+#define TK_BG   4 /* & */
+#define TK_APPEND    5 /* >> */
+#define TK_ERR       6 /* 2> */
+#define TK_ERRAPPEND 7 /* 2>> */
+#define TK_ERRDUP    8 /* 2>&1 */
+#define TK_HEREDOC   9 /* << */
+#define TK_HERESTR  10 /* <<< */
+#define TK_PSUBIN   11 /* <( at the start of a word */
+#define TK_PSUBOUT  12 /* >( at the start of a word */
+#define TK_FANOUT   13 /* |+ */
+
+/* openredirs: the stderr of a "2>&1" before any ">" is the stage's own stdout */
+#define FD_STDOUT (-2)
 
 /* Job states */
 #define UNDEF 0 /* undefined */
@@ -24,6 +102,11 @@
 #define BG 2    /* running in background */
 #define ST 3    /* stopped */
 
+/* Process states (one process per pipeline stage) */
+#define PS_RUNNING 0 /* running */
+#define PS_STOPPED 1 /* stopped */
+#define PS_DONE    2 /* terminated and reaped */
+
 /* 
  * Jobs states: FG (foreground), BG (background), ST (stopped)
  * Job state transitions and enabling actions:
@@ -32,23 +115,260 @@
  *     ST -> BG  : bg command
  *     BG -> FG  : fg command
  * At most 1 job can be in the FG state.
+ * A job is stopped once all of its live processes are stopped, and is
+ * deleted once all of them have terminated.
  */
 
 /* Global variables */
 extern char **environ;      /* defined in libc */
 char prompt[] = "tsh> ";    /* command line prompt (DO NOT CHANGE) */
 int verbose = 0;            /* if true, print additional output */
+int script = 0;             /* if true, commands come from a file or pipe: no prompt, buffered output */
+int emit_prompt = 1;        /* emit prompts (default; -p turns them off) */
 char sbuf[MAXLINE];         /* for composing sprintf messages */
+const int fdorder[3] = { STDIN_FILENO, STDERR_FILENO, STDOUT_FILENO }; /* see applyfds */
+long timeauto = -1;         /* time -t: time every foreground job slower than this (ms), -1 = off */
+int strict = 0;             /* if true, trivial utilities are always exec'd, never run in-process */
+int bstatus = 0;            /* exit status of the last builtin or in-process utility */
+
+struct place_t {            /* Where the processes of a job run (run --cpus/--mem-node/--cgroup) */
+    cpu_set_t cpus;         /* the CPUs they may run on, if setcpus */
+    int setcpus;            /* if true, their CPU affinity is set to cpus */
+    int node;               /* NUMA node their memory is bound to, -1 for the default policy */
+    int cgroup;             /* if true, they are contained in a cgroup of their own */
+};
+
+#define NLIMITS 9           /* number of resource limits ulimit knows (see limitinfo) */
+
+struct limits_t {           /* Resource limits of a job's processes (ulimit, run --limit) */
+    struct rlimit rl[NLIMITS]; /* the limits, in limitinfo order */
+    unsigned int set;       /* bit i set if rl[i] is applied, else the shell's own is inherited */
+};
+
+struct limit_t {            /* A resource limit ulimit knows */
+    char opt;               /* its ulimit option letter */
+    char *name;             /* its name for run --limit and jobs -l */
+    int resource;           /* RLIMIT_... */
+    rlim_t unit;            /* bytes per unit of the values given and shown (1 or 1024) */
+    char *desc;             /* what ulimit -a calls it */
+};
+
+struct proc_t {             /* Per-process data (one per pipeline stage) */
+    pid_t pid;              /* process ID */
+    int pidfd;              /* pidfd of the process, -1 if none */
+    int state;              /* PS_RUNNING, PS_STOPPED or PS_DONE */
+    int status;             /* wait status of the last stop, or of the exit once PS_DONE */
+    struct timespec changed; /* when the last stop or exit was collected (CLOCK_MONOTONIC) */
+    struct rusage ru;       /* resource usage reported by wait4, once PS_DONE */
+    struct job_t *job;      /* job the process belongs to */
+    struct proc_t *hnext;   /* next process in the same PID hash bucket */
+};
 
 struct job_t {              /* Per-job data */
-    pid_t pid;              /* job PID */
+    pid_t pid;              /* job PID (the first process of the pipeline) */
+    pid_t pgid;             /* process group of all of the job's processes */
     int jid;                /* job ID [1, 2, ...] */
     int state;              /* UNDEF, FG, BG, or ST */
-    char cmdline[MAXLINE];  /* command line */
+    struct proc_t *procs;   /* the job's processes, in pipeline order */
+    int nprocs;             /* number of processes in the job */
+    int maxprocs;           /* size of procs (kept when the record is reused) */
+    int nlive;              /* processes not yet reaped */
+    struct timespec start;  /* when the job was started (CLOCK_MONOTONIC) */
+    char *cmdline;          /* command line */
+    size_t cmdsize;         /* size of cmdline (kept when the record is reused) */
+    long timed;             /* report resource usage at exit if it took at least this many ms, -1 = never */
+    int item;               /* parallel item (1, 2, ...) the job runs, 0 if none */
+    struct place_t place;   /* where it was placed by run --cpus/--mem-node */
+    struct limits_t limits; /* the resource limits its processes were started with */
+    int cgfd;               /* its cgroup directory (open), -1 if it has none */
+    int cgid;               /* the number N of that cgroup, "jobN" */
+    struct job_t *next;     /* next record on the free list */
+};
+
+struct joblist_t {          /* The job list, indexed by JID and by PID */
+    struct job_t **byjid;   /* byjid[jid - 1], NULL where the JID is free */
+    unsigned long *jidmap;  /* bitmap of the JIDs in use */
+    int maxjobs;            /* size of byjid (grows on demand) */
+    struct proc_t **bypid;  /* PID hash table of every job process, chained through hnext */
+    int nbuckets;           /* size of bypid (a power of 2) */
+    int njobs;              /* number of jobs in the list */
+    int nprocs;             /* number of processes in the PID hash */
+    struct job_t *fg;       /* cached foreground job (check its state), or NULL */
+    struct job_t *freelist; /* cleared job records ready for reuse */
+    int unwatched;          /* processes we could not get a pidfd for (e.g. out of fds) */
+};
+struct joblist_t jobs;      /* The job list */
+
+int epfd;                   /* epoll set of the event loop: input, signals, job pidfds */
+int sigfd;                  /* signalfd for SIGINT, SIGTSTP, SIGCHLD and SIGQUIT */
+sigset_t origmask;          /* signal mask to restore in children */
+
+struct input_t {            /* Buffered command input */
+    int fd;                 /* file descriptor commands are read from */
+    int pollable;           /* if true, fd can be watched by epoll (not a regular file) */
+    int ready;              /* set by the event loop when fd is readable */
+    int eof;                /* end of input seen */
+    size_t start, end;      /* unread data is buf[start..end) */
+    size_t size;            /* size of buf (grows to hold the longest line) */
+    char *buf;
+};
+struct input_t input;       /* The command input */
+
+struct chunk_t {            /* A block of arena memory */
+    struct chunk_t *next;   /* the previously filled chunk */
+    size_t size;            /* bytes in data */
+    size_t used;            /* bytes handed out */
+    char data[];
+};
+
+struct arena_t {            /* Bump allocator for the memory of one command line */
+    struct chunk_t *chunks; /* current chunk first */
+    size_t total;           /* size of all chunks */
+};
+struct arena_t cmdarena;    /* Tokens and argv of the current command, reset between commands */
+
+struct redir_t {            /* A redirection of a pipeline stage */
+    int kind;               /* its operator (TK_IN, TK_OUT, ...) */
+    int fd;                 /* descriptor of the stage it sets (0, 1 or 2) */
+    int flags;              /* open() flags of path */
+    char *path;             /* file to open, the "<<" delimiter, the "<<<" text, or NULL for "2>&1" */
+    int doc;                /* for "<<": index of its text in plan_t.docs */
+};
+
+struct stage_t {            /* A command of a pipeline */
+    char **argv;            /* its words, without the redirections */
+    struct redir_t *redirs; /* its redirections, in the order they apply */
+    int nredirs;            /* number of redirections */
+    int inshell;            /* if true, run by builtin_cmd in a forked shell, not exec'd */
+    struct psub_t *psubs;   /* its process substitutions, in argv order */
+    int npsubs;             /* number of process substitutions */
 };
-struct job_t jobs[MAXJOBS]; /* The job list */
 
-volatile sig_atomic_t ready; /* Is the newest child in its own process group? */
+struct psub_t {             /* A process substitution "<(cmd ...)" or ">(cmd ...)", or a fan-out branch */
+    int out;                /* 0 for "<(": the stage reads cmd's output; 1 for ">(": cmd reads the stage's */
+    char *word;             /* the word standing for it in the stage's argv (compared by address) */
+    int argi;               /* index of that word, which is replaced by a /dev/fd path */
+    char **argv;            /* the words of its pipeline, while the plan is compiled */
+    unsigned char *kinds;   /* their token kinds */
+    int argc;               /* number of words */
+    int first;              /* index in plan_t.stages of the first stage of its pipeline */
+    int nstages;            /* number of stages of its pipeline (0 for a branch that is a file) */
+};
+
+struct plan_t {             /* A validated command line, ready to run */
+    char **argv;            /* its words (split into the stage argvs) */
+    int argc;               /* number of words */
+    int bg;                 /* if true, run it in the background */
+    int builtin;            /* if true, its single stage is run by builtin_cmd in the shell itself */
+    int nstages;            /* number of pipeline stages */
+    struct stage_t *stages; /* the pipeline stages, then those of the process substitutions */
+    int nall;               /* number of stages, with those of the process substitutions */
+    struct psub_t *psubs;   /* the process substitutions */
+    int npsubs;             /* number of process substitutions */
+    struct psub_t *branches; /* the branches that get a copy of the pipeline's output ("|+") */
+    int nbranches;          /* number of branches */
+    int ndocs;              /* number of "<<" here-documents */
+    char **docs;            /* their text, read from the input for each run (not cached) */
+};
+
+struct launch_t {           /* A job being started by startjob */
+    struct plan_t *plan;    /* its plan */
+    int (*redirs)[3];       /* per stage: the descriptors its redirections set (see openredirs) */
+    pid_t *pids;            /* the processes started so far */
+    int nprocs;             /* number of them */
+    pid_t pgid;             /* process group of the job (PID of its first process), 0 until then */
+    struct place_t *place;  /* where its processes run, or NULL to leave that alone */
+    struct limits_t *limits; /* the resource limits of its processes */
+    int cgfd;               /* its cgroup directory (open), -1 if it has none */
+    int cgid;               /* the number of that cgroup */
+};
+
+struct centry_t {           /* A command line in the plan cache */
+    uint64_t hash;          /* hash of line */
+    char *line;             /* the command line (in arena), NULL if the entry is free */
+    struct plan_t plan;     /* its compiled plan (in arena) */
+    struct arena_t arena;   /* memory of line and plan, reused when the entry is evicted */
+    struct centry_t *hnext; /* next entry in the same hash bucket */
+    struct centry_t *prev;  /* LRU list, most recently used first */
+    struct centry_t *next;
+};
+
+struct plancache_t {        /* Compiled plans of the most recently used command lines */
+    struct centry_t entries[CACHESIZE];
+    struct centry_t *buckets[CACHEBUCKETS];
+    struct centry_t lru;    /* head of the LRU list (free entries are at its tail) */
+    int nlines;             /* entries in use */
+    unsigned long hits;     /* lines whose plan was found in the cache */
+    unsigned long misses;   /* lines that had to be compiled */
+};
+struct plancache_t plancache; /* The plan cache */
+
+int cgparent = -1;          /* our own cgroup v2 directory (open), -1 if not used */
+int cgroot = -1;            /* the cgroup "tsh-PID" in it that holds the job cgroups, -1 if none */
+char cgname[32];            /* its name */
+pid_t cgowner;              /* the shell (not a forked child) that made it */
+int cgseq = 0;              /* number of the last job cgroup made */
+int cgclone = 1;            /* if true, children are started in their cgroup by clone3 */
+
+struct limit_t limitinfo[NLIMITS] = { /* The limits ulimit knows, by option letter */
+    { 'c', "core", RLIMIT_CORE, 1024, "core file size (KB)" },
+    { 'd', "data", RLIMIT_DATA, 1024, "data seg size (KB)" },
+    { 'f', "fsize", RLIMIT_FSIZE, 1024, "file size (KB)" },
+    { 'l', "memlock", RLIMIT_MEMLOCK, 1024, "max locked memory (KB)" },
+    { 'n', "nofile", RLIMIT_NOFILE, 1, "open files" },
+    { 's', "stack", RLIMIT_STACK, 1024, "stack size (KB)" },
+    { 't', "cpu", RLIMIT_CPU, 1, "cpu time (seconds)" },
+    { 'u', "nproc", RLIMIT_NPROC, 1, "max user processes" },
+    { 'v', "as", RLIMIT_AS, 1024, "virtual memory (KB)" },
+};
+struct limits_t shlimits;   /* ulimit: the limits every job starts with (none set: inherit ours) */
+
+struct util_t {             /* A trivial utility run in-process (unless strict) */
+    char *name;             /* its name, also matched as /bin/name and /usr/bin/name */
+    int (*run)(char **argv); /* runs it with stdout as output, returns its exit status */
+};
+
+struct scan_t {             /* Metacharacter bitmaps of a command line (bit i = byte i) */
+    uint64_t *spaces;       /* ' ' */
+    uint64_t *quotes;       /* '\'' */
+    uint64_t *ops;          /* '|', '<', '>' and '&' */
+};
+/* classifies n 64-byte blocks; set by initscan to the best one for this CPU */
+void (*scanblocks)(const char *p, size_t n, uint64_t *spaces, uint64_t *quotes, uint64_t *ops);
+
+struct parallel_t {         /* State of the parallel builtin while it runs */
+    char **argv;            /* command words (in the command arena), NULL when idle */
+    int argc;               /* number of command words */
+    char **items;           /* the arguments after ":::", one per item */
+    int nitems;             /* number of items */
+    int next;               /* items started so far */
+    int running;            /* items running now */
+    int maxjobs;            /* -j: max items running at once */
+    int failed;             /* items that exited non-zero or were killed */
+    int stopped;            /* items stopped now */
+    int halted;             /* an item was stopped, or ctrl-c or ctrl-z typed: start no more items */
+};
+struct parallel_t par;      /* The parallel builtin */
+
+struct event_t {            /* A collected child state change */
+    pid_t pid;              /* process that stopped or terminated */
+    int status;             /* its wait status */
+    struct rusage ru;       /* its resource usage if it terminated */
+    struct timespec time;   /* when it was collected (CLOCK_MONOTONIC) */
+};
+
+struct evqueue_t {          /* Queue of collected child events */
+    struct event_t events[MAXQUEUED];
+    int n;                  /* number of queued events */
+    int full;               /* the SIGCHLD scan stopped early because the queue was full */
+};
+struct evqueue_t evq;       /* Child events waiting to be applied to the job list */
+
+struct msgbuf_t {           /* Job messages of the current batch */
+    size_t len;
+    char buf[MSGSIZE];
+};
+struct msgbuf_t msgs;       /* The pending job messages */
 
 /* End global variables */
 
@@ -57,28 +377,149 @@ volatile sig_atomic_t ready; /* Is the newest child in its own process group? */
 
 /* Here are the functions that you will implement */
 void eval(char *cmdline);
+void evalrun(char *cmdline, long timed);
+void evaljob(char *cmdline, long timed, struct place_t *place, struct limits_t *limits);
 int builtin_cmd(char **argv);
 void do_bgfg(char **argv);
+void do_parallel(char **argv);
+void do_cache(char **argv);
+void do_ulimit(char **argv);
+void startitem(void);
+void runbuiltin(struct plan_t *plan);
 void waitfg(pid_t pid);
+void runevents(int timeout);
+void readsignals(void);
+void initinput(int fd);
+int readline(char **cmdline, struct arena_t *arena);
+void waitinput(void);
 void sigchld_handler(int sig);
 void sigint_handler(int sig);
 void sigtstp_handler(int sig);
 
+/* Pipeline helpers */
+int compileplan(char *cmdline, struct plan_t *plan, struct arena_t *arena);
+int isbuiltin(char *name);
+void initcache(void);
+void clearcache(void);
+int cacheplan(char *cmdline, struct plan_t *plan);
+uint64_t linehash(const char *line, size_t len);
+void touchentry(struct centry_t *e);
+int parsestages(int argc, char **argv, unsigned char *kinds, struct stage_t *stages, struct redir_t *redirs);
+int takesubs(struct plan_t *plan, unsigned char *kinds, struct arena_t *arena);
+int attachsubs(struct plan_t *plan);
+int takebranches(struct plan_t *plan, unsigned char *kinds, struct arena_t *arena);
+int addstages(struct plan_t *plan, struct psub_t *p, int file);
+pid_t startjob(struct plan_t *plan, int state, char *cmdline, struct place_t *place, struct limits_t *limits);
+int startstages(struct launch_t *l, struct stage_t *stages, int n, int in, int out);
+pid_t startstage(struct launch_t *l, struct stage_t *stage, char **argv, int fdv[3], int *keep, int nkeep);
+int startfanout(struct launch_t *l, int in);
+void abortlaunch(struct launch_t *l);
+int fanout(int in, int *outs, int n);
+int openredirs(struct stage_t *stage, char **docs, int rv[3], int *opened, int *nopened);
+int opentext(const char *text);
+int readdocs(struct plan_t *plan);
+char *readdoc(char *delim);
+void stagefds(int rv[3], int in, int out, int fdv[3]);
+int applyfds(int fdv[3], int saved[3]);
+void restorefds(int saved[3]);
+void closefds(int *fds, int n);
+void closeexcept(int *keep, int n);
+void applyplace(struct place_t *place);
+pid_t forkinto(int cgfd);
+int parsecpus(const char *list, cpu_set_t *cpus);
+char *fmtcpus(cpu_set_t *cpus, char *buf);
+#ifdef USE_SPAWN
+pid_t spawn_cmd(char **argv, pid_t pgid, int fdv[3], int *keep, int nkeep, sigset_t *mask);
+#endif
+
 /* Here are helper routines that we've provided for you */
-int parseline(const char *cmdline, char **argv); 
+int parseline(const char *cmdline, char ***argvp, unsigned char **kindsp, struct arena_t *arena);
+int opkind(const char *word);
+void *arenaalloc(struct arena_t *arena, size_t n);
+void arenareset(struct arena_t *arena);
+
+/* In-process utilities */
+struct util_t *getutil(char *name);
+int util_true(char **argv);
+int util_false(char **argv);
+int util_echo(char **argv);
+int util_printf(char **argv);
+int util_test(char **argv);
+const char *unescape(const char *s, int zero, int *c);
+int putescapes(const char *s);
+int testexpr(void);
+int testand(void);
+int testnot(void);
+int testprimary(void);
+int testbinary(char *a, char *op, char *b);
+int testunary(char *op, char *a);
+long long testint(char *s);
+
+/* Metacharacter scanner */
+void initscan(void);
+void scanline(const char *buf, size_t len, struct scan_t *scan);
+void scanblocks_scalar(const char *p, size_t n, uint64_t *spaces, uint64_t *quotes, uint64_t *ops);
+#ifdef SCAN_X86
+void scanblocks_sse2(const char *p, size_t n, uint64_t *spaces, uint64_t *quotes, uint64_t *ops);
+void scanblocks_avx2(const char *p, size_t n, uint64_t *spaces, uint64_t *quotes, uint64_t *ops);
+#endif
+size_t nextbit(const uint64_t *map, size_t i, size_t n);
+#ifdef SCANBENCH
+int scanbench(int argc, char **argv);
+#endif
 void sigquit_handler(int sig);
-void sigusr1_handler(int sig);
 
 void clearjob(struct job_t *job);
-void initjobs(struct job_t *jobs);
-int freejid(struct job_t *jobs); 
-int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline);
-int deletejob(struct job_t *jobs, pid_t pid); 
-pid_t fgpid(struct job_t *jobs);
-struct job_t *getjobpid(struct job_t *jobs, pid_t pid);
-struct job_t *getjobjid(struct job_t *jobs, int jid); 
+void initjobs(struct joblist_t *jobs);
+int growjobs(struct joblist_t *jobs, int maxjobs);
+int rehashjobs(struct joblist_t *jobs, int nbuckets);
+unsigned int pidhash(struct joblist_t *jobs, pid_t pid);
+int freejid(struct joblist_t *jobs); 
+int addjob(struct joblist_t *jobs, pid_t *pids, int nprocs, int state, char *cmdline);
+int deletejob(struct joblist_t *jobs, pid_t pid); 
+pid_t fgpid(struct joblist_t *jobs);
+struct job_t *getjobpid(struct joblist_t *jobs, pid_t pid);
+struct proc_t *getproc(struct joblist_t *jobs, pid_t pid);
+struct job_t *getjobjid(struct joblist_t *jobs, int jid); 
 int pid2jid(pid_t pid); 
-void listjobs(struct job_t *jobs);
+void listjobs(struct joblist_t *jobs, int usage);
+void reapproc(struct proc_t *proc);
+int waitstatus(siginfo_t *info);
+void pushevent(pid_t pid, int status, struct rusage *ru);
+void applyevents(void);
+void stopproc(struct proc_t *proc, int status);
+void finishproc(struct proc_t *proc, int status, struct rusage *ru);
+void report(const char *fmt, ...);
+void flushreports(void);
+int signaljob(struct job_t *job, int sig);
+void resumejob(struct job_t *job, int state);
+
+/* Resource accounting helpers */
+void addusage(struct rusage *sum, struct rusage *ru);
+int procusage(pid_t pid, struct rusage *ru);
+void jobusage(struct job_t *job, struct rusage *ru, struct timespec *wall);
+void reportusage(struct job_t *job);
+void elapsed(struct timespec *from, struct timespec *to, struct timespec *d);
+char *fmtusage(struct rusage *ru, struct timespec *wall);
+
+/* cgroup helpers */
+int initcgroup(void);
+void exitcgroup(void);
+void prunecgroup(int parent, const char *name);
+int cgwrite(int dirfd, const char *file, const char *text);
+int newcgroup(int *id);
+void dropcgroup(int fd, int id);
+void signalescapees(struct job_t *job, int sig);
+char *fmtcgroup(struct job_t *job);
+
+/* Resource limit helpers */
+int findlimit(char opt, const char *name, size_t len);
+int parselimit(const char *s, int i, rlim_t *v);
+char *fmtlimit(rlim_t v, int i, char *buf);
+void getlimit(struct limits_t *limits, int i, struct rlimit *rl);
+void setlimit(struct limits_t *limits, int i, struct rlimit *rl);
+void applylimits(struct limits_t *limits);
+const char *limitkill(struct job_t *job, struct proc_t *proc);
 
 void usage(void);
 void unix_error(char *msg);
@@ -91,15 +532,19 @@ handler_t *Signal(int signum, handler_t *handler);
  */
 int main(int argc, char **argv) {
     char c;
-    char cmdline[MAXLINE];
-    int emit_prompt = 1; /* emit prompt (default) */
+    char *cmdline;
+
+    initscan();
+#ifdef SCANBENCH
+    return scanbench(argc, argv);
+#endif
 
     /* Redirect stderr to stdout (so that driver will get all output
      * on the pipe connected to stdout) */
     dup2(STDOUT_FILENO, STDERR_FILENO);
 
     /* Parse the command line */
-    while ((c = getopt(argc, argv, "hvp")) != -1) {
+    while ((c = getopt(argc, argv, "hvps")) != -1) {
         switch (c) {
             case 'h':             /* print help message */
                 usage();
@@ -110,25 +555,50 @@ int main(int argc, char **argv) {
             case 'p':             /* don't print a prompt */
                 emit_prompt = 0;  /* handy for automatic testing */
                 break;
+            case 's':             /* strict /bin semantics: exec every utility */
+                strict = 1;
+                break;
             default:
                 usage();
         }
     }
 
-    /* Install the signal handlers */
-
-    Signal(SIGUSR1, sigusr1_handler); /* Child is ready */
-
-    /* These are the ones you will need to implement */
-    Signal(SIGINT,  sigint_handler);   /* ctrl-c */
-    Signal(SIGTSTP, sigtstp_handler);  /* ctrl-z */
-    Signal(SIGCHLD, sigchld_handler);  /* Terminated or stopped child */
+    /* Read commands from the script file if one is given. Unless they come
+     * from a terminal, run in script mode: no prompt, and stdout is fully
+     * buffered instead of flushed after every command. */
+    int fd = STDIN_FILENO;
+    if (optind < argc && (fd = open(argv[optind], O_RDONLY | O_CLOEXEC)) < 0) {
+        printf("%s: %s\n", argv[optind], strerror(errno));
+        exit(1);
+    }
+    if (!isatty(fd)) {
+        script = 1;
+        emit_prompt = 0;
+        setvbuf(stdout, NULL, _IOFBF, OUTBUFSIZE);
+    }
 
-    /* This one provides a clean way to kill the shell */
-    Signal(SIGQUIT, sigquit_handler); 
+    /* Route the signals to a signalfd instead of installing handlers:
+     * they are handled synchronously by the event loop, which is the only
+     * place where the job list changes. */
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);   /* ctrl-c */
+    sigaddset(&mask, SIGTSTP);  /* ctrl-z */
+    sigaddset(&mask, SIGCHLD);  /* Terminated or stopped child */
+    sigaddset(&mask, SIGQUIT);  /* a clean way to kill the shell */
+    sigprocmask(SIG_BLOCK, &mask, &origmask);
+    if ((sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+        unix_error("signalfd error");
 
-    /* Initialize the job list */
-    initjobs(jobs);
+    /* Initialize the event loop and the job list */
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        unix_error("epoll_create1 error");
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EV_SIGNALS };
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev) < 0)
+        unix_error("epoll_ctl error");
+    initjobs(&jobs);
+    initinput(fd);
+    initcache();
 
     /* Execute the shell's read/eval loop */
     while (1) {
@@ -138,16 +608,22 @@ int main(int argc, char **argv) {
             printf("%s", prompt);
             fflush(stdout);
         }
-        if ((fgets(cmdline, MAXLINE, stdin) == NULL) && ferror(stdin))
-            app_error("fgets error");
-        if (feof(stdin)) { /* End of file (ctrl-d) */
+        /* Handle whatever happened to the jobs since the last command,
+         * then wait for a complete line, handling events meanwhile */
+        runevents(0);
+        arenareset(&cmdarena);
+        int r;
+        while ((r = readline(&cmdline, &cmdarena)) == 0)
+            waitinput();
+        if (r < 0) { /* End of file (ctrl-d) */
             fflush(stdout);
             exit(0);
         }
 
         /* Evaluate the command line */
         eval(cmdline);
-        fflush(stdout);
+        if (!script)
+            fflush(stdout);
     } 
 
     exit(0); /* control never reaches here */
@@ -157,670 +633,3756 @@ int main(int argc, char **argv) {
  * eval - Evaluate the command line that the user has just typed in
  * 
  * If the user has requested a built-in command (quit, jobs, bg or fg)
- * then execute it immediately. Otherwise, fork a child process and
- * run the job in the context of the child. If the job is running in
- * the foreground, wait for it to terminate and then return.  Note:
- * each child process must have a unique process group ID so that our
+ * then execute it immediately. Otherwise, fork a child process for
+ * each stage of the pipeline and run the job in the context of those
+ * children. If the job is running in the foreground, wait for it to
+ * terminate and then return.  Note:
+ * each job must have a unique process group ID so that our
  * background children don't receive SIGINT (SIGTSTP) from the kernel
  * when we type ctrl-c (ctrl-z) at the keyboard.  
+ *
+ * A "time [-t ms]" prefix is taken off first: the rest of the line is
+ * run as usual and its resource usage reported when it exits (only if
+ * it took at least ms milliseconds). "time -t ms" on its own does that
+ * for every foreground job from then on ("time -t off" stops it).
 */
 void eval(char *cmdline) {
-    // declare variables
-    int fork_pid;
-    char *argv[MAXARGS];
-    int argc = parseline(cmdline, argv);
-    int bg = 0;
-    
-    // set volatile variable `ready` to 0
-    ready = 0;
+    char *p = cmdline + strspn(cmdline, " \t");
+    char *end;
+    long timed = 0;
 
-    // check if cmdline is empty
-    if (argv[0] == NULL)  // Without this, an empty cmdline input causes Segmentation Fault.
+    if (strncmp(p, "time", 4) != 0 || !isspace((unsigned char)p[4])) {
+        evalrun(cmdline, -1);
         return;
-    if (!strcmp(argv[argc - 1], "&")) {
-        bg = 1;
-        argv[argc - 1] = NULL;
     }
-    // check if it's a built-in command
-    if (!builtin_cmd(argv)) {  // if not, execute code below
-        // block SIGINT, SIGTSTP
-        sigset_t blockmask, oldmask;
-        sigemptyset(&blockmask);
-        sigaddset(&blockmask, SIGINT);
-        sigaddset(&blockmask, SIGTSTP);
-        sigprocmask(SIG_BLOCK, &blockmask, &oldmask);
-
-        // fork
-        if ((fork_pid = fork()) < 0) {
-            perror("fork");
-            exit(1);
-        }
-        // CHILD PROCESS
-        // -------------
-        else if (fork_pid == 0) {
-            // set process group id for main child process
-            setpgid(0, 0);
-
-            // let parent know that process group id has been set
-            kill(getppid(), SIGUSR1);
-
-            // uninstall the SIGCHLD handler for child process (so that it can wait for its own children)
-            struct sigaction childact;
-            childact.sa_handler = SIG_DFL;
-            childact.sa_flags = 0;
-            sigemptyset(&childact.sa_mask);
-            sigaction(SIGCHLD, &childact, NULL);
-
-            // ---------------------------------------------------------------------------------------
-
-            int i;
-            int pipe_encountered = 0;  // if ("|" encountered) any following "<" renders the cmdline INVALID.
-            int out_redir_encountered = 0;  // if (">" encountered) any following "|" renders the cmdline INVALID.
-            // ERROR CHECKS
-            for (i = 0; i < argc && argv[i] != NULL; i++) {
-                // update flags
-                if (!strcmp(argv[i], "|"))
-                    pipe_encountered = 1;
-                if (!strcmp(argv[i], ">"))
-                    out_redir_encountered = 1;
-                // ERROR CHECK: argv[0] is obviously not a command
-                if (!strcmp(argv[0], "<") || !strcmp(argv[0], ">") || !strcmp(argv[0], "|")) {
-                    printf("Invalid commandline\n");
-                    exit(1);
-                }
-                // ERROR CHECK: invalid argument to i/o redirectors or pipe operator
-                if (!strcmp(argv[i], "<") || !strcmp(argv[i], ">") || !strcmp(argv[i], "|")) {
-                    if (argv[i + 1] == NULL || !strcmp(argv[i + 1], "<")
-                          || !strcmp(argv[i + 1], ">") || !strcmp(argv[i + 1], "|")) {
-                        printf("Invalid commandline\n");
-                        exit(1);
-                    }
-                }
-                // ERROR CHECK: "<" appears after encountering "|"
-                if (pipe_encountered && !strcmp(argv[i], "<")) {
-                    printf("Invalid commandline: an input redirector \"<\" cannot appear after a pipe \"|\"\n");
-                    exit(1);
-                }
-                // ERROR CHECK: "|" appears after encountering ">"
-                if (out_redir_encountered && !strcmp(argv[i], "|")) {
-                    printf("Invalid commandline: a pipe operator \"|\" cannot appear after an output redirector \">\"\n");
-                    exit(1);
-                }
-            }
-            // 1. Detect pointers in argv that point to "|", "<", or ">".
-            // 2. Replace such pointers with a NULL pointer.
-            // 3. Remember the index position.
-            int pipe_count = 0;
-            int is_pipe[MAXARGS] = {0};
-            int is_inredir[MAXARGS] = {0};
-            int is_outredir[MAXARGS] = {0};
-            for (i = 0; i < argc && argv[i] != NULL; i++) {
-                if (!strcmp(argv[i], "|")) {
-                    is_pipe[i] = 1;
-                    argv[i] = NULL;
-                    pipe_count++;
-                } else if (!strcmp(argv[i], "<")) {
-                    is_inredir[i] = 1;
-                    argv[i] = NULL;
-                } else if (!strcmp(argv[i], ">")) {
-                    is_outredir[i] = 1;
-                    argv[i] = NULL;
-                }
-            }
-            //int fd_stdin_backup = dup(fileno(stdin));
-            //int fd_stdout_backup = dup(fileno(stdout));
-            int fds[pipe_count][2];
-            int i_fd = -1;
-            int skip_this_iteration = 0;
-            char **argv_ptr = argv;
-            for (i = 0; i < argc; i++) {
-                //printf("ITERATION (%d):\n", i);
-                //printf("argv[%d] = %s\n", i, argv[i]);
-                if (skip_this_iteration) {  // due to argv[i - 1] having been "<", ">", or "|"
-                    if (is_pipe[i - 1]) {
-                        argv_ptr = &argv[i];
-                        //printf("--- after `*argv_ptr += i`...");
-                        //printf("  argv_ptr[0] = %s \n\n", argv_ptr[0]);
-                    }
-                    skip_this_iteration = 0;
-                    continue;
-                }
-                // USAGE: /bin/ls | /bin/grep e | /bin/grep drive
-
-                if (is_inredir[i]) {
-                    skip_this_iteration = 1;
-                    int fdin = open(argv[i + 1], O_RDONLY);
-                    dup2(fdin, fileno(stdin));
-                }
-
-                else if (is_outredir[i]) {
-                    skip_this_iteration = 1;
-                    int fdout = open(argv[i + 1], O_WRONLY | O_CREAT, 0644);
-                    dup2(fdout, fileno(stdout));
-                }
-
-                else if (is_pipe[i]) {
-                    skip_this_iteration = 1;
-                    i_fd++;
-                    if (pipe(fds[i_fd]) == -1) {
-                        perror("pipe");
-                        exit(1);
-                    }
-                    int r = fork();
-                    if (r < 0) {
-                        perror("fork");
-                        exit(1);
-                    } else if (r == 0) {  // SUB-CHILD
-                        close(fds[i_fd][0]);
-                        dup2(fds[i_fd][1], fileno(stdout));
-                        close(fds[i_fd][1]);
-
-                        // unblock SIGINT, SIGTSTP
-                        sigprocmask(SIG_SETMASK, &oldmask, NULL);
-                        // execute command
-                        execve(argv_ptr[0], argv_ptr, environ);  //TODO
-                        printf("%s: Command not found\n", argv_ptr[0]);
-                        exit(1);
-                    } else {              // MAIN-CHILD
-                        close(fds[i_fd][1]);
-                        dup2(fds[i_fd][0], fileno(stdin));
-                        close(fds[i_fd][0]);
-
-                        // The next block of code makes sure that each sub-child executes properly
-                        // and sequentially in a multi-pipe cmdline.
-                        // 
-                        // If one `exec` fails, then the rest of the cmdline is NOT evaluated.
-                        int status;
-                        wait(&status);
-                        if (!WIFEXITED(status))
-                            exit(1);
-                        if (WEXITSTATUS(status) != 0)
-                            exit(1);
-                    }
-                }
-                //printf("END OF ITERATION (%d)\n\n", i);
+    p += 4;
+    p += strspn(p, " \t");
+    if (strncmp(p, "-t", 2) == 0 && isspace((unsigned char)p[2])) {
+        p += 2;
+        p += strspn(p, " \t");
+        if (strncmp(p, "off", 3) == 0 && isspace((unsigned char)p[3])) {
+            timed = -1;
+            end = p + 3;
+        } else {
+            timed = strtol(p, &end, 10);
+            if (end == p || timed < 0 || !isspace((unsigned char)*end)) {
+                printf("time: -t requires a number of milliseconds\n");
+                return;
             }
-            // unblock SIGINT, SIGTSTP
-            sigprocmask(SIG_SETMASK, &oldmask, NULL);
-            // execute command
-            execve(argv_ptr[0], argv_ptr, environ);
-            printf("%s: Command not found\n", argv_ptr[0]);
-            exit(1);
-        }
-        // PARENT PROCESS
-        // --------------
-        while (!ready);  // block until the child has set its own process group id
-
-        // BACK-GROUND
-        if (bg) {
-            addjob(jobs, fork_pid, BG, cmdline);
-            // unblock SIGINT, SIGTSTP
-            sigprocmask(SIG_SETMASK, &oldmask, NULL);
-            // BG process update
-            printf("[%d] (%d) %s", pid2jid(fork_pid), fork_pid, cmdline);
-        }
-        // FORE-GROUND
-        else {
-            addjob(jobs, fork_pid, FG, cmdline);
-            // unblock SIGINT, SIGTSTP
-            sigprocmask(SIG_SETMASK, &oldmask, NULL);
-            waitfg(fork_pid);
+        }
+        p = end + strspn(end, " \t");
+        if (*p == '\n' || *p == '\0') {  // no command: set the automatic threshold
+            timeauto = timed;
+            return;
         }
     }
-    return;
+    if (*p == '\n' || *p == '\0' || timed < 0) {
+        printf("time command requires a command line or -t <ms> argument\n");
+        return;
+    }
+    evalrun(p, timed);
 }
 
-/* 
- * parseline - Parse the command line and build the argv array.
- * 
- * Characters enclosed in single quotes are treated as a single
- * argument.  Return number of arguments parsed.
+/*
+ * evalrun - Run a command line, after taking off a "run [--cpus LIST]
+ *    [--mem-node N] [--limit NAME=VALUE]... [--cgroup]" prefix: every
+ *    process of its job is then pinned to the CPUs in LIST (e.g. 0-3,6)
+ *    and/or has its memory bound to NUMA node N, has resource limit NAME
+ *    (e.g. cpu or nofile, see limitinfo) set to VALUE instead of the
+ *    ulimit default, and/or is contained in a cgroup of the job's own.
+ *    All are checked here, before anything is started.
  */
-int parseline(const char *cmdline, char **argv) {
-    static char array[MAXLINE]; /* holds local copy of command line */
-    char *buf = array;          /* ptr that traverses command line */
-    char *delim;                /* points to space or quote delimiters */
-    int argc;                   /* number of args */
-
-    strcpy(buf, cmdline);
-    buf[strlen(buf)-1] = ' ';  /* replace trailing '\n' with space */
-    while (*buf && (*buf == ' ')) /* ignore leading spaces */
-        buf++;
+void evalrun(char *cmdline, long timed) {
+    char *p = cmdline + strspn(cmdline, " \t");
+    struct place_t place = { .setcpus = 0, .node = -1, .cgroup = 0 };
+    struct limits_t limits = shlimits;
+    cpu_set_t usable;
+    char *end, *eq, path[64];
+    long node;
+    rlim_t v;
+    int i;
 
-    /* Build the argv list */
-    argc = 0;
-    if (*buf == '\'') {
-        buf++;
-        delim = strchr(buf, '\'');
-    }
-    else {
-        delim = strchr(buf, ' ');
+    if (strncmp(p, "run", 3) != 0 || !isspace((unsigned char)p[3])) {
+        evaljob(cmdline, timed, NULL, NULL);
+        return;
     }
-
-    while (delim) {
-        argv[argc++] = buf;
-        *delim = '\0';
-        buf = delim + 1;
-        while (*buf && (*buf == ' ')) /* ignore spaces */
-            buf++;
-
-        if (*buf == '\'') {
-            buf++;
-            delim = strchr(buf, '\'');
-        }
-        else {
-            delim = strchr(buf, ' ');
+    for (p += 3; ; p = end) {
+        p += strspn(p, " \t");
+        if (strncmp(p, "--cpus", 6) == 0 && isspace((unsigned char)p[6])) {
+            p += 6;
+            p += strspn(p, " \t");
+            end = p + strcspn(p, " \t\n");
+            char c = *end;
+            *end = '\0';
+            if (parsecpus(p, &place.cpus) < 0) {
+                printf("run: --cpus requires a list of CPUs such as 0-3,6\n");
+                return;
+            }
+            *end = c;
+            // the kernel refuses a set with none of the CPUs we may use
+            sched_getaffinity(0, sizeof(usable), &usable);
+            CPU_AND(&usable, &usable, &place.cpus);
+            if (CPU_COUNT(&usable) == 0) {
+                printf("run: none of these CPUs can be used\n");
+                return;
+            }
+            place.setcpus = 1;
+        } else if (strncmp(p, "--mem-node", 10) == 0 && isspace((unsigned char)p[10])) {
+            p += 10;
+            p += strspn(p, " \t");
+            node = strtol(p, &end, 10);
+            if (end == p || !isspace((unsigned char)*end)) {
+                printf("run: --mem-node requires a NUMA node number\n");
+                return;
+            }
+            sprintf(path, "/sys/devices/system/node/node%ld", node);
+            if (node < 0 || node >= MAXNODES || access(path, F_OK) < 0) {
+                printf("run: no NUMA node %ld\n", node);
+                return;
+            }
+            place.node = node;
+        } else if (strncmp(p, "--limit", 7) == 0 && isspace((unsigned char)p[7])) {
+            p += 7;
+            p += strspn(p, " \t");
+            end = p + strcspn(p, " \t\n");
+            char c = *end;
+            *end = '\0';
+            if ((eq = strchr(p, '=')) == NULL || (i = findlimit(0, p, eq - p)) < 0
+                  || parselimit(eq + 1, i, &v) < 0) {
+                printf("run: --limit requires NAME=VALUE, such as cpu=10 or nofile=64\n");
+                return;
+            }
+            *end = c;
+            struct rlimit rl = { .rlim_cur = v, .rlim_max = v };
+            setlimit(&limits, i, &rl);
+        } else if (strncmp(p, "--cgroup", 8) == 0 && isspace((unsigned char)p[8])) {
+            end = p + 8;
+            if (initcgroup() < 0)
+                return;
+            place.cgroup = 1;
+        } else {
+            break;
         }
     }
-    argv[argc] = NULL;
-    
-    return argc;
+    if (*p == '\n' || *p == '\0') {
+        printf("run: usage: run [--cpus LIST] [--mem-node N] [--limit NAME=VALUE]... [--cgroup] command line\n");
+        return;
+    }
+    evaljob(p, timed, &place, &limits);
 }
 
-/* 
- * builtin_cmd - If the user has typed a built-in command then execute
- *    it immediately.  
+/*
+ * evaljob - Run a command line (a builtin or a job). If timed >= 0 the
+ *    job's resource usage is reported when it exits if it took at least
+ *    timed ms; foreground jobs otherwise use the time -t threshold. If
+ *    place is not NULL, the job's processes are placed there (a builtin
+ *    run by the shell itself is not). Their resource limits are limits,
+ *    or the ulimit defaults if NULL.
  */
-int builtin_cmd(char **argv) {
+void evaljob(char *cmdline, long timed, struct place_t *place, struct limits_t *limits) {
+    struct plan_t plan;         // the command line, validated and split into stages
+    pid_t pgid;                 // process group of the job (PID of its first process)
+    struct job_t *job;
 
-    if(strcmp(argv[0], "quit") == 0) {
-        exit(1);
+    // nothing is started unless the whole line is valid
+    if (!cacheplan(cmdline, &plan))
+        return;
+    // the text of the here-documents follows the command line in the input
+    if (plan.ndocs > 0 && readdocs(&plan) < 0)
+        return;
+    // check if it's a built-in command
+    if (plan.builtin) {
+        runbuiltin(&plan);
+        return;
     }
-    if(strcmp(argv[0], "jobs") == 0) {
-        listjobs(jobs);
-        return 1;
+    if ((pgid = startjob(&plan, plan.bg ? BG : FG, cmdline, place, limits)) == 0)
+        return;
+    if (timed < 0 && !plan.bg)
+        timed = timeauto;
+    job = getjobpid(&jobs, pgid);
+    job->timed = timed;
+    if (place != NULL)
+        job->place = *place;
+    // BACK-GROUND
+    if (plan.bg) {
+        // BG process update
+        printf("[%d] (%d) %s", pid2jid(pgid), pgid, cmdline);
     }
-
-    int res_bg = strcmp(argv[0], "bg");
-    int res_fg = strcmp(argv[0], "fg");
-
-    if(res_fg == 0 || res_bg == 0) {
-        do_bgfg(argv);
-        return 1;
+    // FORE-GROUND
+    else {
+        waitfg(pgid);
     }
-
-    return 0;     /* not a builtin command */
-    
+    return;
 }
 
-/* 
- * do_bgfg - Execute the builtin bg and fg commands
+/*
+ * compileplan - Parse cmdline and check it in the parent, before anything
+ *    is forked, into a plan whose memory comes from arena. Returns 0 if
+ *    the line is empty or invalid (after printing why), else 1.
  */
-void do_bgfg(char **argv) {
-    pid_t pid;
-    int jid;
-    int argc = 0;
-    char bufarg[MAXARGS];
-    struct job_t *job;
+int compileplan(char *cmdline, struct plan_t *plan, struct arena_t *arena) {
+    unsigned char *kinds;       // token kind of each word
+    char *name;                 // command name of a stage
+    struct redir_t *redirs;     // room for the redirections of every stage
+    struct psub_t *p;
+    int s;
 
-    while (argv[argc] != NULL) {
-        argc++;
+    memset(plan, 0, sizeof(*plan));
+    plan->argc = parseline(cmdline, &plan->argv, &kinds, arena);
+    // check if cmdline is empty
+    if (plan->argc == 0)  // Without this, an empty cmdline input causes Segmentation Fault.
+        return 0;
+    if (kinds[plan->argc - 1] == TK_BG) {
+        plan->bg = 1;
+        plan->argv[--plan->argc] = NULL;
+        if (plan->argc == 0)
+            return 0;
     }
-    if (!strcmp(argv[0], "bg")) {
-        // error checks
-        if (argc != 2) {
-            printf("bg command requires PID or %%jid argument\n");
-            return;
-        }
-        // case_1: second arg = %jid
-        if (argv[1][0] == '%') {
-            if (argv[1][1] == '\0' || !isdigit(argv[1][1])) {
-                printf("%s: No such job\n", argv[1]);
-                return;
-            }
-            strncpy(bufarg, &argv[1][1], sizeof(bufarg));
-            bufarg[MAXARGS - 1] = '\0';
-            jid = atol(bufarg);
-            if ((job = getjobjid(jobs, jid)) == NULL) {
-                printf("%s: No such job\n", argv[1]);
-                return;
+    // every stage has at least one word, so argc stages and redirections are enough
+    plan->stages = arenaalloc(arena, plan->argc * sizeof(*plan->stages));
+    redirs = arenaalloc(arena, plan->argc * sizeof(*redirs));
+    if (takesubs(plan, kinds, arena) < 0 || takebranches(plan, kinds, arena) < 0)
+        return 0;
+    plan->nstages = parsestages(plan->argc, plan->argv, kinds, plan->stages, redirs);
+    if (plan->nstages == 0)
+        return 0;
+    // the branches of the fan-out, then the pipelines of the process
+    // substitutions, follow in the same arrays
+    plan->nall = plan->nstages;
+    for (p = plan->branches; p < plan->branches + plan->nbranches; p++)
+        if (!addstages(plan, p, 1))
+            return 0;
+    for (p = plan->psubs; p < plan->psubs + plan->npsubs; p++)
+        if (!addstages(plan, p, 0))
+            return 0;
+    if (attachsubs(plan) < 0)
+        return 0;
+    for (s = 0; s < plan->nall; s++) {
+        struct stage_t *stage = &plan->stages[s];
+        struct redir_t *r;
+        for (r = stage->redirs; r < stage->redirs + stage->nredirs; r++) {
+            if (r->kind == TK_HEREDOC)
+                r->doc = plan->ndocs++;
+            if (r->kind == TK_HERESTR) {  // a here-string is its word and a newline
+                size_t len = strlen(r->path);
+                char *text = arenaalloc(arena, len + 2);
+                memcpy(text, r->path, len);
+                strcpy(&text[len], "\n");
+                r->path = text;
             }
-            kill(-(job->pid), SIGCONT);
-            job->state = BG;
-            printf("[%d] (%d) %s", jid, job->pid, job->cmdline);
-            return;
-        }
-        // case_2: second arg = PID
-        if (!isdigit(argv[1][0])) {
-            printf("bg: argument must be a PID or %%jid\n");
-            return;
         }
-        pid = atol(argv[1]);
-        if ((job = getjobpid(jobs, pid)) == NULL) {
-            printf("(%d): No such process\n", pid);
-            return;
+        if ((name = stage->argv[0]) == NULL)
+            continue;  // the file of a fan-out branch
+        plan->stages[s].inshell = isbuiltin(name) || (!strict && getutil(name) != NULL);
+        // these act on the shell's own jobs, which a forked copy cannot do
+        if (plan->nall > 1 && (!strcmp(name, "fg") || !strcmp(name, "bg") || !strcmp(name, "parallel"))) {
+            printf("%s: job control commands cannot be part of a pipeline\n", name);
+            return 0;
         }
-        kill(-(job->pid), SIGCONT);
-        job->state = BG;
-        printf("[%d] (%d) %s", job->jid, pid, job->cmdline);
-        return;
+    }
+    // A lone builtin runs in the shell itself ("&" is ignored, as before),
+    // and so does a lone foreground utility: it needs no process at all.
+    if (plan->nall == 1 && plan->stages[0].inshell)
+        plan->builtin = isbuiltin(plan->argv[0]) || !plan->bg;
+    return 1;
+}
 
+/*
+ * takesubs - Take the process substitutions out of the plan's words: the
+ *    words from one starting with "<(" or ">(" up to the first one ending
+ *    with ")" become the words of its pipeline (in plan->psubs), and are
+ *    replaced in argv by the single word where it starts. Returns the
+ *    number of process substitutions, or -1 (after printing why) if one
+ *    is empty, nested or not closed.
+ */
+int takesubs(struct plan_t *plan, unsigned char *kinds, struct arena_t *arena) {
+    char **argv = plan->argv;
+    struct psub_t *p;
+    int i, j, k, w, n = 0;
 
-    } else if (!strcmp(argv[0], "fg")) {
-        // error checks
-        if (argc != 2) {
-            printf("fg command requires PID or %%jid argument\n");
-            return;
+    for (i = 0; i < plan->argc; i++)
+        if (kinds[i] == TK_PSUBIN || kinds[i] == TK_PSUBOUT)
+            n++;
+    if (n == 0)
+        return 0;
+    plan->psubs = arenaalloc(arena, n * sizeof(*plan->psubs));
+    for (i = 0, w = 0; i < plan->argc; i++) {
+        if (kinds[i] != TK_PSUBIN && kinds[i] != TK_PSUBOUT) {
+            argv[w] = argv[i];
+            kinds[w++] = kinds[i];
+            continue;
         }
-        // case_1: second arg = %jid
-        if (argv[1][0] == '%') {
-            if (argv[1][1] == '\0' || !isdigit(argv[1][1])) {
-                printf("%s: No such job\n", argv[1]);
-                return;
-            }
-            strncpy(bufarg, &argv[1][1], sizeof(bufarg));
-            bufarg[MAXARGS - 1] = '\0';
-            jid = atol(bufarg);
-            if ((job = getjobjid(jobs, jid)) == NULL) {
-                printf("%s: No such job\n", argv[1]);
-                return;
+        // find the word that closes it; the first one needs more than "<("
+        for (j = i; j < plan->argc; j++) {
+            size_t len = strlen(argv[j]);
+            if (j > i && (kinds[j] == TK_PSUBIN || kinds[j] == TK_PSUBOUT)) {
+                j = plan->argc;  // nested
+                break;
             }
-            kill(-(job->pid), SIGCONT);
-            job->state = FG;
-            waitfg(job->pid);
-            return;
+            if (len > (j == i ? 2 : 0) && argv[j][len - 1] == ')')
+                break;
         }
-        // case_2: second arg = PID
-        if (!isdigit(argv[1][0])) {
-            printf("fg: argument must be a PID or %%jid\n");
-            return;
+        if (j == plan->argc) {
+            printf("Invalid commandline: a process substitution \"%.2s\" must be closed by \")\" and cannot be nested\n", argv[i]);
+            return -1;
         }
-        pid = atol(argv[1]);
-        if ((job = getjobpid(jobs, pid)) == NULL) {
-            printf("(%d): No such process\n", pid);
-            return;
+        p = &plan->psubs[plan->npsubs++];
+        p->out = (kinds[i] == TK_PSUBOUT);
+        p->word = argv[i];
+        p->argv = arenaalloc(arena, (j - i + 2) * sizeof(*p->argv));
+        p->kinds = arenaalloc(arena, j - i + 2);
+        p->argc = 0;
+        argv[j][strlen(argv[j]) - 1] = '\0';
+        for (k = i; k <= j; k++) {
+            char *word = (k == i) ? argv[k] + 2 : argv[k];
+            if (*word == '\0')
+                continue;
+            p->argv[p->argc] = word;
+            // the words cut from "<(" or ")" are classified again
+            p->kinds[p->argc++] = (k == i || k == j) ? opkind(word) : kinds[k];
         }
-        kill(-(job->pid), SIGCONT);
-        job->state = FG;
-        waitfg(pid);
-        return;
+        p->argv[p->argc] = NULL;
+        p->kinds[p->argc] = TK_WORD;
+        if (p->argc == 0) {
+            printf("Invalid commandline: empty process substitution\n");
+            return -1;
+        }
+        argv[w] = argv[i];
+        kinds[w++] = TK_WORD;
+        i = j;
     }
-
-    return;
+    argv[w] = NULL;
+    kinds[w] = TK_WORD;
+    plan->argc = w;
+    return plan->npsubs;
 }
 
-/* 
- * waitfg - Block until process pid is no longer the foreground process
+/*
+ * attachsubs - Give each stage of the pipeline and of the fan-out branches
+ *    its process substitutions, found by their word in its argv. Returns -1 (after printing why) if one is
+ *    not an argument, e.g. the file of a redirection.
  */
-void waitfg(pid_t pid) {
-    sigset_t mask;
-
-    // Mask is now an empty set, this is because we do not want sigsuspend
-    // to block any signal.
-
-    sigemptyset(&mask);
-
-    while(pid == fgpid(jobs)){
+int attachsubs(struct plan_t *plan) {
+    struct psub_t *p = plan->psubs;
+    struct stage_t *stage;
+    int s, i;
+    int nouter = (plan->npsubs > 0) ? p->first : plan->nall;  // stages not in a substitution
 
-        //sigsuspend, suspends the process here until any singal is recieved
-        //by handle, it then checks if process pid is still the foreground
-        //process, if it is not, then the loop breaks.
+    for (s = 0; s < plan->nall; s++) {
+        stage = &plan->stages[s];
+        stage->psubs = p;
+        stage->npsubs = 0;
+        for (i = 0; s < nouter && stage->argv[i] != NULL; i++) {
+            if (p < plan->psubs + plan->npsubs && stage->argv[i] == p->word) {
+                p->argi = i;
+                stage->npsubs++;
+                p++;
+            }
+        }
+    }
+    if (p != plan->psubs + plan->npsubs) {
+        printf("Invalid commandline: a process substitution must be an argument of a command\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * takebranches - Split the plan's words at the fan-out operators "|+": the
+ *    words before the first one stay the plan's pipeline, and those after
+ *    each one become a branch (in plan->branches) that gets a copy of the
+ *    pipeline's output. Returns the number of branches, or -1 (after
+ *    printing why) if one is empty or the output is already redirected.
+ */
+int takebranches(struct plan_t *plan, unsigned char *kinds, struct arena_t *arena) {
+    char **argv = plan->argv;
+    int argc = plan->argc;
+    struct psub_t *b;
+    int i, n = 0;
+
+    for (i = 0; i < argc; i++)
+        if (kinds[i] == TK_FANOUT)
+            n++;
+    if (n == 0)
+        return 0;
+    for (i = 0; kinds[i] != TK_FANOUT; i++) {
+        // ERROR CHECK: "|+" appears after encountering ">"
+        if (kinds[i] == TK_OUT || kinds[i] == TK_APPEND) {
+            printf("Invalid commandline: a fan-out operator \"|+\" cannot appear after an output redirector \">\"\n");
+            return -1;
+        }
+    }
+    plan->argc = i;
+    plan->branches = arenaalloc(arena, n * sizeof(*plan->branches));
+    // each "|+" becomes the NULL that ends the words before it
+    while (i < argc) {
+        argv[i] = NULL;
+        kinds[i++] = TK_WORD;
+        b = &plan->branches[plan->nbranches++];
+        b->argv = &argv[i];
+        b->kinds = &kinds[i];
+        while (i < argc && kinds[i] != TK_FANOUT)
+            i++;
+        b->argc = &argv[i] - b->argv;
+        if (b->argc == 0 || plan->argc == 0) {
+            printf("Invalid commandline\n");
+            return -1;
+        }
+    }
+    return n;
+}
+
+/*
+ * addstages - Compile the words of a process substitution or fan-out
+ *    branch into the next stages of the plan. If file is true, a branch
+ *    that is just "> file" or ">> file" becomes a stage with no command
+ *    and that redirection. Returns 0 (after printing why) if it is invalid.
+ */
+int addstages(struct plan_t *plan, struct psub_t *p, int file) {
+    struct stage_t *stage = &plan->stages[plan->nall];
+    struct redir_t *r = stage[-1].redirs + stage[-1].nredirs;  // the first free redirection
+
+    p->first = plan->nall;
+    if (file && p->argc == 2 && (p->kinds[0] == TK_OUT || p->kinds[0] == TK_APPEND) && p->kinds[1] == TK_WORD) {
+        stage->argv = &p->argv[2];
+        stage->redirs = r;
+        stage->nredirs = 1;
+        r->kind = p->kinds[0];
+        r->fd = STDOUT_FILENO;
+        r->flags = O_WRONLY | O_CREAT | (r->kind == TK_APPEND ? O_APPEND : O_TRUNC);
+        r->path = p->argv[1];
+        p->nstages = 0;
+        plan->nall++;
+        return 1;
+    }
+    p->nstages = parsestages(p->argc, p->argv, p->kinds, stage, r);
+    plan->nall += p->nstages;
+    return p->nstages > 0;
+}
+
+/* isbuiltin - Is name one of the commands that builtin_cmd runs? */
+int isbuiltin(char *name) {
+    static char *builtins[] = { "quit", "jobs", "bg", "fg", "parallel", "cache", "ulimit", NULL };
+    int i;
+
+    for (i = 0; builtins[i] != NULL; i++)
+        if (!strcmp(name, builtins[i]))
+            return 1;
+    return 0;
+}
+
+/*
+ * initcache - Put every entry of the plan cache on the LRU list, unused
+ */
+void initcache(void) {
+    int i;
+
+    plancache.lru.prev = plancache.lru.next = &plancache.lru;
+    for (i = 0; i < CACHESIZE; i++) {
+        struct centry_t *e = &plancache.entries[i];
+        e->prev = plancache.lru.prev;
+        e->next = &plancache.lru;
+        e->prev->next = e;
+        plancache.lru.prev = e;
+    }
+}
+
+/*
+ * clearcache - Drop every cached plan (the entries keep their memory)
+ */
+void clearcache(void) {
+    int i;
+
+    for (i = 0; i < CACHESIZE; i++)
+        plancache.entries[i].line = NULL;
+    memset(plancache.buckets, 0, sizeof(plancache.buckets));
+    plancache.nlines = 0;
+}
+
+/*
+ * cacheplan - Get the compiled plan of cmdline into *plan, from the plan
+ *    cache if the same line was seen recently, else by compiling it (and
+ *    caching it in place of the least recently used line). The plan stays
+ *    valid until the next command line is read. Returns 0 if the line is
+ *    empty or invalid, like compileplan.
+ */
+int cacheplan(char *cmdline, struct plan_t *plan) {
+    size_t len = strlen(cmdline);
+    uint64_t hash = linehash(cmdline, len);
+    struct centry_t *e, **bucket = &plancache.buckets[hash & (CACHEBUCKETS - 1)];
+
+    // blank lines are neither cached nor counted
+    if (cmdline[strspn(cmdline, " \t\n")] == '\0')
+        return 0;
+    for (e = *bucket; e != NULL; e = e->hnext) {
+        if (e->hash == hash && strcmp(e->line, cmdline) == 0) {
+            plancache.hits++;
+            touchentry(e);
+            *plan = e->plan;
+            return 1;
+        }
+    }
+    plancache.misses++;
+    if (len > CACHEMAXLINE)
+        return compileplan(cmdline, plan, &cmdarena);
+
+    // evict the least recently used line
+    e = plancache.lru.prev;
+    if (e->line != NULL) {
+        struct centry_t **pp = &plancache.buckets[e->hash & (CACHEBUCKETS - 1)];
+        while (*pp != e)
+            pp = &(*pp)->hnext;
+        *pp = e->hnext;
+        e->line = NULL;
+        plancache.nlines--;
+    }
+    arenareset(&e->arena);
+    if (!compileplan(cmdline, &e->plan, &e->arena))
+        return 0;  // invalid lines are compiled again every time, to report the error
+    e->hash = hash;
+    e->line = memcpy(arenaalloc(&e->arena, len + 1), cmdline, len + 1);
+    e->hnext = *bucket;
+    *bucket = e;
+    plancache.nlines++;
+    touchentry(e);
+    *plan = e->plan;
+    return 1;
+}
+
+/*
+ * linehash - FNV-1a hash of the len bytes of line
+ */
+uint64_t linehash(const char *line, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char)line[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/*
+ * touchentry - Move e to the front of the LRU list
+ */
+void touchentry(struct centry_t *e) {
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+    e->prev = &plancache.lru;
+    e->next = plancache.lru.next;
+    e->next->prev = e;
+    plancache.lru.next = e;
+}
+
+/*
+ * startjob - Start the pipeline stages of a compiled plan with their
+ *    redirections, process substitutions and fan-out, and add the job to
+ *    the job list in the given state. Its processes are placed as place
+ *    says, if not NULL, and get the resource limits in limits (the ulimit
+ *    defaults if NULL). Returns its PID (which is also its process group),
+ *    or 0 if no process could be started.
+ */
+pid_t startjob(struct plan_t *plan, int state, char *cmdline, struct place_t *place, struct limits_t *limits) {
+    struct launch_t l = { .plan = plan, .place = place, .limits = limits != NULL ? limits : &shlimits };
+    int *opened;                // every descriptor opened for the redirections
+    int nopened = 0, nredirs = 0;
+    int failed;                 // if true, a pipe or process could not be made
+    int s;
+
+    for (s = 0; s < plan->nall; s++)
+        nredirs += plan->stages[s].nredirs;
+    // one process per stage, and one for the fan-out
+    if ((l.pids = malloc((plan->nall + 1) * sizeof(*l.pids) + plan->nall * sizeof(*l.redirs) + nredirs * sizeof(*opened))) == NULL) {
+        perror("malloc");
+        return 0;
+    }
+    l.redirs = (int (*)[3])(l.pids + plan->nall + 1);
+    opened = (int *)(l.redirs + plan->nall);
+    // Flush first: a forked child must not inherit (and write again) our
+    // buffered output, and what we printed so far comes before its output.
+    fflush(stdout);
+
+    // Open the files of every stage up front, so a bad one starts nothing.
+    for (s = 0; s < plan->nall; s++) {
+        if (openredirs(&plan->stages[s], plan->docs, l.redirs[s], opened, &nopened) < 0) {
+            closefds(opened, nopened);
+            free(l.pids);
+            return 0;
+        }
+    }
+    // the job's own cgroup (with run --cgroup), which every one of its
+    // processes starts in
+    l.cgfd = (place != NULL && place->cgroup) ? newcgroup(&l.cgid) : -1;
+    // Out of descriptors or processes, the job is given up on (and what
+    // was started of it killed), but the shell carries on.
+    if (plan->nbranches > 0) {
+        int fds[2];             // from the pipeline to the fan-out process
+        if (pipe2(fds, O_CLOEXEC) == -1) {
+            perror("pipe");
+            failed = 1;
+        } else {
+            failed = startstages(&l, plan->stages, plan->nstages, -1, fds[1]) < 0;
+            close(fds[1]);
+            if (!failed)
+                failed = startfanout(&l, fds[0]) < 0;
+            close(fds[0]);
+        }
+    } else {
+        failed = startstages(&l, plan->stages, plan->nstages, -1, -1) < 0;
+    }
+    closefds(opened, nopened);
+
+    // Child events are only handled by the event loop, so the job is
+    // always in the list before any of its processes can be reaped.
+    if (failed || l.nprocs == 0 || !addjob(&jobs, l.pids, l.nprocs, state, cmdline)) {
+        abortlaunch(&l);
+        l.pgid = 0;
+        if (l.cgfd != -1)
+            dropcgroup(l.cgfd, l.cgid);
+    } else {
+        struct job_t *job = getjobpid(&jobs, l.pgid);
+        job->limits = *l.limits;
+        job->cgfd = l.cgfd;
+        job->cgid = l.cgid;
+    }
+    free(l.pids);
+    return l.pgid;
+}
+
+/*
+ * startstages - Start n stages as a pipeline of the job being launched,
+ *    with in (or the shell's stdin if -1) feeding the first one and out
+ *    (or the shell's stdout) taking the output of the last one. The
+ *    pipelines of a stage's process substitutions are started just before
+ *    it, and it gets their pipe ends as /dev/fd/N arguments. Returns 0, or
+ *    -1 (with the pipes it made closed) if a pipe or process could not be
+ *    made; the processes started so far are left to the caller.
+ */
+int startstages(struct launch_t *l, struct stage_t *stages, int n, int in, int out) {
+    int fds[2];
+    int prev_read = in;         // read end of the pipe feeding the current stage
+    int s, k;
+
+    // Start every stage at once, all in the process group of the first one, so the
+    // stages stream into each other and the job can be stopped/killed as a whole.
+    for (s = 0; s < n; s++) {
+        struct stage_t *stage = &stages[s];
+        char **argv = stage->argv;
+        int *keep = NULL;       // the stage's ends of its process substitution pipes
+        int fdv[3];             // descriptors that become the stage's stdin, stdout and stderr
+        pid_t pid;
+
+        if (stage->npsubs > 0) {
+            // a cached plan must stay intact, so the /dev/fd paths go in a copy of argv
+            int argc;
+            for (argc = 0; stage->argv[argc] != NULL; argc++)
+                ;
+            argv = arenaalloc(&cmdarena, (argc + 1) * sizeof(*argv));
+            memcpy(argv, stage->argv, (argc + 1) * sizeof(*argv));
+            keep = arenaalloc(&cmdarena, stage->npsubs * sizeof(*keep));
+            for (k = 0; k < stage->npsubs; k++) {
+                struct psub_t *p = &stage->psubs[k];
+                int pfds[2];
+                if (pipe2(pfds, O_CLOEXEC) == -1) {
+                    perror("pipe");
+                    closefds(keep, k);
+                    goto fail;
+                }
+                // the producer of "<(" writes into the pipe, the consumer of ">(" reads it
+                if (startstages(l, &l->plan->stages[p->first], p->nstages,
+                                p->out ? pfds[0] : -1, p->out ? -1 : pfds[1]) < 0) {
+                    closefds(pfds, 2);
+                    closefds(keep, k);
+                    goto fail;
+                }
+                close(pfds[!p->out]);
+                keep[k] = pfds[p->out];
+                argv[p->argi] = arenaalloc(&cmdarena, sizeof("/dev/fd/") + 10);
+                sprintf(argv[p->argi], "/dev/fd/%d", keep[k]);
+            }
+        }
+        if (s < n - 1 && pipe2(fds, O_CLOEXEC) == -1) {
+            perror("pipe");
+            closefds(keep, stage->npsubs);
+            goto fail;
+        }
+        stagefds(l->redirs[stage - l->plan->stages], prev_read, (s < n - 1) ? fds[1] : out, fdv);
+        pid = startstage(l, stage, argv, fdv, keep, stage->npsubs);
+        if (pid < 0) {
+            closefds(keep, stage->npsubs);
+            if (s < n - 1)
+                closefds(fds, 2);
+            goto fail;
+        }
+        if (pid > 0) {
+            if (l->pgid == 0)
+                l->pgid = pid;
+            l->pids[l->nprocs++] = pid;
+        }
+        // drop our copies of the pipe ends so that readers see EOF and
+        // writers get SIGPIPE once their reader has gone away (in and
+        // out belong to the caller)
+        closefds(keep, stage->npsubs);
+        if (s > 0)
+            close(prev_read);
+        if (s < n - 1) {
+            close(fds[1]);
+            prev_read = fds[0];
+        }
+    }
+    return 0;
+
+ fail:
+    if (s > 0)
+        close(prev_read);
+    return -1;
+}
+
+/*
+ * startstage - Start one stage of the job being launched, with the fd
+ *    table fdv, argv (its words with the /dev/fd paths), and the nkeep
+ *    descriptors in keep left open for it. Returns its pid, 0 if the
+ *    command could not be started, or -1 if no process could be made.
+ */
+pid_t startstage(struct launch_t *l, struct stage_t *stage, char **argv, int fdv[3], int *keep, int nkeep) {
+    pid_t pid;
+    int k;
+
+#ifdef USE_SPAWN
+    // the process group is set by the spawn attributes, so there is no race;
+    // there are none for a placement, resource limits or a cgroup, which
+    // need a forked child. A spawned child moved into the cgroup afterwards
+    // could already have started processes outside it, and spawning it
+    // straight into the cgroup takes clone3(CLONE_VM | CLONE_VFORK |
+    // CLONE_INTO_CGROUP) on a stack of its own, which libc does not wrap.
+    if (!stage->inshell && l->place == NULL && l->limits->set == 0 && l->cgfd == -1)
+        return spawn_cmd(argv, l->pgid, fdv, keep, nkeep, &origmask);
+#endif
+    pid = forkinto(l->cgfd);
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    // CHILD PROCESS
+    // -------------
+    else if (pid == 0) {
+        // join the job's process group (the parent does the same, so
+        // whichever of the two runs first, the group exists before addjob)
+        setpgid(0, l->pgid);
+        // every descriptor we hold is close-on-exec, so only these three survive
+        applyfds(fdv, NULL);
+        // the shell keeps its signals blocked for the signalfd; restore the mask
+        sigprocmask(SIG_SETMASK, &origmask, NULL);
+        if (l->place != NULL)
+            applyplace(l->place);
+        if (l->limits->set != 0)
+            applylimits(l->limits);
+        if (stage->inshell) {
+            // A builtin stage is this copy of the shell, so nothing is
+            // exec'd and close-on-exec does not apply: close the pipe
+            // and file descriptors by hand so that readers see EOF.
+            closeexcept(keep, nkeep);
+            bstatus = 0;
+            builtin_cmd(argv);
+            fflush(stdout);
+            _exit(bstatus);
+        }
+        // the process substitution pipes are passed on, as /dev/fd/N
+        for (k = 0; k < nkeep; k++)
+            fcntl(keep[k], F_SETFD, 0);
+        // execute command
+        execve(argv[0], argv, environ);
+        printf("%s: Command not found\n", argv[0]);
+        exit(1);
+    }
+    // PARENT PROCESS
+    // --------------
+    // if the child got there first (or has already exec'd), this fails harmlessly
+    setpgid(pid, l->pgid);
+    return pid;
+}
+
+/*
+ * startfanout - Start the fan-out of the job being launched: the process
+ *    that copies everything read from in to each branch (see fanout), then
+ *    the pipelines of the branches, each reading from its own pipe.
+ *    Returns 0, or -1 (with the pipes it made closed) if a pipe or process
+ *    could not be made.
+ */
+int startfanout(struct launch_t *l, int in) {
+    struct plan_t *plan = l->plan;
+    int n = plan->nbranches;
+    int *outs = arenaalloc(&cmdarena, 2 * n * sizeof(*outs));  // what the fan-out writes to
+    int *ins = outs + n;        // the read ends of the pipes, -1 for a file
+    int b, fds[2];
+    pid_t pid;
+
+    for (b = 0; b < n; b++) {
+        struct psub_t *br = &plan->branches[b];
+        ins[b] = -1;
+        if (br->nstages == 0) {
+            outs[b] = l->redirs[br->first][STDOUT_FILENO];  // opened by startjob
+            continue;
+        }
+        if (pipe2(fds, O_CLOEXEC) == -1) {
+            perror("pipe");
+            n = b;              // only these have pipes to close
+            b = 0;
+            goto fail;
+        }
+        ins[b] = fds[0];
+        outs[b] = fds[1];
+    }
+    pid = forkinto(l->cgfd);
+    if (pid < 0) {
+        perror("fork");
+        b = 0;
+        goto fail;
+    }
+    // CHILD PROCESS
+    // -------------
+    else if (pid == 0) {
+        int *keep = arenaalloc(&cmdarena, (n + 1) * sizeof(*keep));
+        setpgid(0, l->pgid);
+        sigprocmask(SIG_SETMASK, &origmask, NULL);
+        if (l->place != NULL)
+            applyplace(l->place);
+        // (not the job's resource limits: they are meant for its commands,
+        // and a low nofile or cpu limit would cut every branch short)
+        // nothing is exec'd: close what the shell holds by hand (see startstage)
+        keep[0] = in;
+        memcpy(&keep[1], outs, n * sizeof(*outs));
+        closeexcept(keep, n + 1);
+        _exit(fanout(in, outs, n));
+    }
+    // PARENT PROCESS
+    // --------------
+    setpgid(pid, l->pgid);
+    if (l->pgid == 0)
+        l->pgid = pid;
+    l->pids[l->nprocs++] = pid;
+    for (b = 0; b < n; b++) {
+        struct psub_t *br = &plan->branches[b];
+        if (ins[b] == -1)
+            continue;
+        close(outs[b]);
+        if (startstages(l, &plan->stages[br->first], br->nstages, ins[b], -1) < 0) {
+            close(ins[b]);
+            b++;
+            goto fail;
+        }
+        close(ins[b]);
+    }
+    return 0;
+
+ fail:
+    // close the pipes of the branches not started yet
+    for (; b < n; b++) {
+        if (ins[b] != -1) {
+            close(ins[b]);
+            close(outs[b]);
+        }
+    }
+    return -1;
+}
+
+/*
+ * abortlaunch - Kill and reap the processes started so far of a job that
+ *    could not be started as a whole
+ */
+void abortlaunch(struct launch_t *l) {
+    int i;
+
+    if (l->nprocs == 0)
+        return;
+    if (l->cgfd == -1 || cgwrite(l->cgfd, "cgroup.kill", "1") < 0)
+        kill(-l->pgid, SIGKILL);
+    for (i = 0; i < l->nprocs; i++)
+        waitpid(l->pids[i], NULL, 0);
+    l->nprocs = 0;
+}
+
+/*
+ * fanout - Copy everything from the pipe in to the n descriptors in outs
+ *    (pipes or files) without bringing it into user space. Each buffer is
+ *    moved from in to a pipe of one page, which holds a single buffer that
+ *    tee(2) always passes on whole: it is duplicated into every output pipe
+ *    (through a spare pipe that splice(2) empties into a file for a file),
+ *    then discarded. tee waits for room in its reader's pipe, so the
+ *    slowest consumer sets the pace. An output whose reader has gone is
+ *    dropped; with none left, fanout returns and the producer gets
+ *    SIGPIPE. Returns the exit status of the fan-out process.
+ */
+int fanout(int in, int *outs, int n) {
+    int buf[2], spill[2], null;
+    char *ispipe = malloc(n);
+    int i, live = n, status = 0;
+    ssize_t len = 0, r, w;
+    struct stat st;
+
+    Signal(SIGPIPE, SIG_IGN);
+    if (ispipe == NULL || pipe(buf) < 0 || pipe(spill) < 0 || (null = open("/dev/null", O_WRONLY)) < 0) {
+        perror("fanout");
+        return 1;
+    }
+    fcntl(buf[1], F_SETPIPE_SZ, 0);  // rounded up to one page, the least there is
+    for (i = 0; i < n; i++) {
+        ispipe[i] = (fstat(outs[i], &st) == 0 && S_ISFIFO(st.st_mode));
+        // splice(2) refuses O_APPEND files: write from their end instead
+        if (!ispipe[i] && (fcntl(outs[i], F_GETFL) & O_APPEND)) {
+            fcntl(outs[i], F_SETFL, fcntl(outs[i], F_GETFL) & ~O_APPEND);
+            lseek(outs[i], 0, SEEK_END);
+        }
+    }
+    while (live > 0 && (len = splice(in, NULL, buf[1], NULL, 1 << 16, 0)) > 0) {
+        for (i = 0; i < n; i++) {
+            if (outs[i] == -1)
+                continue;
+            if (ispipe[i]) {
+                r = tee(buf[0], outs[i], len, 0);
+            } else {
+                // a file cannot be tee'd to: fill the spare pipe and move that into it
+                w = 0;
+                if (tee(buf[0], spill[1], len, 0) == len) {
+                    while (w < len && (r = splice(spill[0], NULL, outs[i], NULL, len - w, 0)) > 0)
+                        w += r;
+                    if (w < len)
+                        splice(spill[0], NULL, null, NULL, len - w, 0);  // drop what is left
+                }
+                r = w;
+            }
+            if (r != len) {
+                if (!ispipe[i] || errno != EPIPE) {
+                    perror("fanout");
+                    status = 1;
+                }
+                close(outs[i]);
+                outs[i] = -1;
+                live--;
+            }
+        }
+        splice(buf[0], NULL, null, NULL, len, 0);
+    }
+    if (len < 0) {
+        perror("fanout");
+        status = 1;
+    }
+    return status;
+}
+
+/*
+ * parsestages - Check the syntax of the operators in argv (their positions
+ *    are given by the token kinds from parseline) and split it into
+ *    pipeline stages. Each stage's redirections are taken out of its argv
+ *    (which stays NULL-terminated) into redirs, which has room for argc
+ *    entries. Prints an error message and returns 0 if the command line is
+ *    invalid, else the number of stages.
+ */
+int parsestages(int argc, char **argv, unsigned char *kinds, struct stage_t *stages, struct redir_t *redirs) {
+    int i, w, kind;
+    int pipe_encountered = 0;  // if ("|" encountered) any following "<" renders the cmdline INVALID.
+    int out_redir_encountered = 0;  // if (">" encountered) any following "|" renders the cmdline INVALID.
+    int nstages = 1;
+    struct stage_t *stage;
+    struct redir_t *r;
+
+    // ERROR CHECKS
+    for (i = 0; i < argc && argv[i] != NULL; i++) {
+        // update flags
+        if (kinds[i] == TK_PIPE)
+            pipe_encountered = 1;
+        if (kinds[i] == TK_OUT || kinds[i] == TK_APPEND)
+            out_redir_encountered = 1;
+        // ERROR CHECK: argv[0] is obviously not a command
+        if (kinds[0] != TK_WORD && kinds[0] != TK_BG) {
+            printf("Invalid commandline\n");
+            return 0;
+        }
+        // ERROR CHECK: invalid argument to i/o redirectors or pipe operator
+        if (kinds[i] != TK_WORD && kinds[i] != TK_BG && kinds[i] != TK_ERRDUP) {
+            if (argv[i + 1] == NULL || (kinds[i + 1] != TK_WORD && kinds[i + 1] != TK_BG)) {
+                printf("Invalid commandline\n");
+                return 0;
+            }
+        }
+        // ERROR CHECK: "|+" is only taken at the top level (see takebranches)
+        if (kinds[i] == TK_FANOUT) {
+            printf("Invalid commandline: a fan-out operator \"|+\" cannot appear in a process substitution\n");
+            return 0;
+        }
+        // ERROR CHECK: "<" appears after encountering "|"
+        if (pipe_encountered && (kinds[i] == TK_IN || kinds[i] == TK_HEREDOC || kinds[i] == TK_HERESTR)) {
+            printf("Invalid commandline: an input redirector \"<\" cannot appear after a pipe \"|\"\n");
+            return 0;
+        }
+        // ERROR CHECK: "|" appears after encountering ">"
+        if (out_redir_encountered && kinds[i] == TK_PIPE) {
+            printf("Invalid commandline: a pipe operator \"|\" cannot appear after an output redirector \">\"\n");
+            return 0;
+        }
+    }
+    // Split argv in place: the words of each stage are moved down over its
+    // operators and end with a NULL (where its "|" was), and its
+    // redirections go to the next entries of redirs.
+    stage = &stages[0];
+    stage->argv = argv;
+    stage->redirs = redirs;
+    stage->nredirs = 0;
+    for (i = 0, w = 0; i < argc && argv[i] != NULL; i++) {
+        if (kinds[i] == TK_WORD || kinds[i] == TK_BG) {
+            argv[w++] = argv[i];
+            continue;
+        }
+        if (kinds[i] == TK_PIPE) {
+            argv[w++] = NULL;
+            stage = &stages[nstages++];
+            stage->argv = &argv[w];
+            stage->redirs = redirs;
+            stage->nredirs = 0;
+            continue;
+        }
+        r = redirs++;
+        stage->nredirs++;
+        kind = kinds[i];
+        r->kind = kind;
+        r->path = (kind == TK_ERRDUP) ? NULL : argv[++i];
+        switch (kind) {
+            case TK_IN:
+            case TK_HEREDOC:
+            case TK_HERESTR:   r->fd = STDIN_FILENO; r->flags = O_RDONLY; break;
+            case TK_OUT:       r->fd = STDOUT_FILENO; r->flags = O_WRONLY | O_CREAT | O_TRUNC; break;
+            case TK_APPEND:    r->fd = STDOUT_FILENO; r->flags = O_WRONLY | O_CREAT | O_APPEND; break;
+            case TK_ERR:       r->fd = STDERR_FILENO; r->flags = O_WRONLY | O_CREAT | O_TRUNC; break;
+            case TK_ERRAPPEND: r->fd = STDERR_FILENO; r->flags = O_WRONLY | O_CREAT | O_APPEND; break;
+            default:           r->fd = STDERR_FILENO; r->flags = 0; break;  // 2>&1
+        }
+    }
+    argv[w] = NULL;
+    return nstages;
+}
+
+/*
+ * openredirs - Open the files of a stage's redirections (close-on-exec),
+ *    in order, and set rv[t] to the descriptor that its fd t gets: -1 if
+ *    none, or FD_STDOUT for a "2>&1" that came before any ">". Here-docs
+ *    and here-strings get a descriptor holding their text (docs are the
+ *    texts of the plan's here-docs). The opened descriptors are added to
+ *    opened[*nopened]. Returns -1 on error.
+ */
+int openredirs(struct stage_t *stage, char **docs, int rv[3], int *opened, int *nopened) {
+    struct redir_t *r;
+    int fd;
+
+    rv[0] = rv[1] = rv[2] = -1;
+    for (r = stage->redirs; r < stage->redirs + stage->nredirs; r++) {
+        if (r->kind == TK_ERRDUP) {
+            rv[STDERR_FILENO] = (rv[STDOUT_FILENO] != -1) ? rv[STDOUT_FILENO] : FD_STDOUT;
+            continue;
+        }
+        if (r->kind == TK_HEREDOC || r->kind == TK_HERESTR)
+            fd = opentext((r->kind == TK_HEREDOC) ? docs[r->doc] : r->path);
+        else if ((fd = open(r->path, r->flags | O_CLOEXEC, 0644)) < 0)
+            perror(r->path);
+        if (fd < 0)
+            return -1;
+        opened[(*nopened)++] = fd;
+        rv[r->fd] = fd;
+    }
+    return 0;
+}
+
+/*
+ * opentext - Return a descriptor (close-on-exec) to read text from: a pipe
+ *    already holding it if it fits in the pipe without blocking, else an
+ *    anonymous memfd file. Nothing touches the filesystem. Returns -1 on
+ *    error.
+ */
+int opentext(const char *text) {
+    size_t len = strlen(text), done;
+    ssize_t n;
+    int fds[2];
+
+    if (len <= PIPE_BUF) {
+        if (pipe2(fds, O_CLOEXEC) < 0) {
+            perror("pipe");
+            return -1;
+        }
+        if (len > 0 && write(fds[1], text, len) < 0)
+            perror("write");
+        close(fds[1]);
+        return fds[0];
+    }
+    if ((fds[0] = memfd_create("tsh-heredoc", MFD_CLOEXEC)) < 0) {
+        perror("memfd_create");
+        return -1;
+    }
+    for (done = 0; done < len; done += n) {
+        if ((n = write(fds[0], text + done, len - done)) < 0) {
+            perror("write");
+            close(fds[0]);
+            return -1;
+        }
+    }
+    lseek(fds[0], 0, SEEK_SET);
+    return fds[0];
+}
+
+/*
+ * readdocs - Read the text of the plan's here-documents, in order, from
+ *    the command input into plan->docs (in the command arena). Returns -1
+ *    if there is not enough memory.
+ */
+int readdocs(struct plan_t *plan) {
+    struct redir_t *r;
+    int s;
+
+    plan->docs = arenaalloc(&cmdarena, plan->ndocs * sizeof(*plan->docs));
+    for (s = 0; s < plan->nall; s++) {
+        for (r = plan->stages[s].redirs; r < plan->stages[s].redirs + plan->stages[s].nredirs; r++) {
+            if (r->kind == TK_HEREDOC && (plan->docs[r->doc] = readdoc(r->path)) == NULL)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * readdoc - Read input lines up to a line that is just delim, and return
+ *    them (in the command arena), or NULL if there is not enough memory.
+ *    A last line that is just delim ends it even without a newline; if
+ *    the input ends before delim, what was read is used, as other shells do.
+ */
+char *readdoc(char *delim) {
+    size_t dlen = strlen(delim), len = 0, size = 0, n;
+    char *line, *buf = NULL, *doc;
+    int r;
+
+    while (1) {
+        if (emit_prompt) {
+            printf("> ");
+            fflush(stdout);
+        }
+        while ((r = readline(&line, &cmdarena)) == 0)
+            waitinput();
+        if (r < 0) {
+            // the delimiter may be the last line of the input, without a '\n'
+            if (input.end - input.start == dlen && memcmp(&input.buf[input.start], delim, dlen) == 0)
+                input.start = input.end;
+            else
+                printf("warning: here-document delimited by end-of-file (wanted `%s')\n", delim);
+            break;
+        }
+        n = strlen(line);
+        if (n == dlen + 1 && strncmp(line, delim, dlen) == 0)
+            break;
+        if (len + n > size) {
+            char *grown = realloc(buf, size = 2 * (len + n));
+            if (grown == NULL) {
+                perror("realloc");
+                free(buf);
+                return NULL;
+            }
+            buf = grown;
+        }
+        memcpy(&buf[len], line, n);
+        len += n;
+    }
+    doc = arenaalloc(&cmdarena, len + 1);
+    if (len > 0)
+        memcpy(doc, buf, len);
+    doc[len] = '\0';
+    free(buf);
+    return doc;
+}
+
+/*
+ * stagefds - Build the fd table of a stage: fdv[t] is the descriptor that
+ *    becomes its fd t, or -1 to inherit the shell's. The redirections rv
+ *    (from openredirs) win over in and out, the pipe ends (or -1).
+ */
+void stagefds(int rv[3], int in, int out, int fdv[3]) {
+    fdv[STDIN_FILENO] = (rv[STDIN_FILENO] != -1) ? rv[STDIN_FILENO] : in;
+    fdv[STDOUT_FILENO] = (rv[STDOUT_FILENO] != -1) ? rv[STDOUT_FILENO] : out;
+    if (rv[STDERR_FILENO] == FD_STDOUT)
+        fdv[STDERR_FILENO] = (out != -1) ? out : STDOUT_FILENO;
+    else
+        fdv[STDERR_FILENO] = rv[STDERR_FILENO];
+}
+
+/*
+ * applyfds - Install the fd table fdv, with at most one dup2 per fd and
+ *    none where it is unchanged. stderr goes before stdout (fdorder), so
+ *    that a "2>&1" meaning the shell's own stdout (fdv[2] == 1) is not
+ *    changed by a later ">". If saved is not NULL, the replaced fds are
+ *    first saved there for restorefds. Returns -1 on error.
+ */
+int applyfds(int fdv[3], int saved[3]) {
+    int i, t;
+
+    if (saved != NULL)
+        saved[0] = saved[1] = saved[2] = -1;
+    for (i = 0; i < 3; i++) {
+        t = fdorder[i];
+        if (fdv[t] == -1 || fdv[t] == t)
+            continue;
+        if (saved != NULL && (saved[t] = fcntl(t, F_DUPFD_CLOEXEC, 3)) < 0)
+            return -1;
+        if (dup2(fdv[t], t) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* restorefds - Put back the fds saved by applyfds */
+void restorefds(int saved[3]) {
+    int t;
+
+    for (t = 0; t < 3; t++) {
+        if (saved[t] != -1) {
+            dup2(saved[t], t);
+            close(saved[t]);
+        }
+    }
+}
+
+/* closefds - Close the n descriptors in fds */
+void closefds(int *fds, int n) {
+    while (n > 0)
+        close(fds[--n]);
+}
+
+/*
+ * applyplace - Place the calling process (a job's child, before it execs):
+ *    set its CPU affinity and bind its memory to a NUMA node. Whatever it
+ *    starts inherits both.
+ */
+void applyplace(struct place_t *place) {
+    unsigned long nodes[MAXNODES / (8 * sizeof(unsigned long))] = { 0 };
+    int bits = 8 * sizeof(unsigned long);
+
+    if (place->setcpus && sched_setaffinity(0, sizeof(place->cpus), &place->cpus) < 0)
+        perror("sched_setaffinity");
+    if (place->node >= 0) {
+        nodes[place->node / bits] |= 1UL << (place->node % bits);
+        // no libc wrapper; maxnode counts one more than the bits in nodes
+        if (syscall(SYS_set_mempolicy, MPOL_BIND, nodes, (unsigned long)MAXNODES + 1) < 0)
+            perror("set_mempolicy");
+    }
+}
+
+/*
+ * forkinto - Fork a child that starts out in the cgroup whose directory is
+ *    cgfd (unless -1): it is created there by clone3(CLONE_INTO_CGROUP)
+ *    where the kernel can, so none of its descendants is ever outside;
+ *    else the child moves itself there before doing anything else.
+ */
+pid_t forkinto(int cgfd) {
+    struct cloneargs_t args = { .flags = CLONE_INTO_CGROUP, .exit_signal = SIGCHLD, .cgroup = cgfd };
+    pid_t pid;
+
+    if (cgfd != -1 && cgclone) {
+        if ((pid = syscall(SYS_clone3, &args, sizeof(args))) >= 0)
+            return pid;
+        if (errno == ENOSYS || errno == E2BIG || errno == EINVAL)
+            cgclone = 0;  // too old a kernel: do not try again
+    }
+    pid = fork();
+    if (pid == 0 && cgfd != -1)
+        cgwrite(cgfd, "cgroup.procs", "0");
+    return pid;
+}
+
+/*
+ * parsecpus - Parse a CPU list such as "0-3,6" into cpus. Returns -1 if
+ *    it is malformed or names a CPU beyond CPU_SETSIZE.
+ */
+int parsecpus(const char *list, cpu_set_t *cpus) {
+    const char *p = list;
+    char *end;
+    long lo, hi;
+
+    CPU_ZERO(cpus);
+    do {
+        lo = hi = strtol(p, &end, 10);
+        if (end == p || lo < 0)
+            return -1;
+        if (*end == '-') {
+            p = end + 1;
+            hi = strtol(p, &end, 10);
+            if (end == p || hi < lo)
+                return -1;
+        }
+        if (hi >= CPU_SETSIZE)
+            return -1;
+        for (; lo <= hi; lo++)
+            CPU_SET(lo, cpus);
+        p = end + 1;
+    } while (*end == ',');
+    return (*end == '\0') ? 0 : -1;
+}
+
+/*
+ * fmtcpus - Write the CPUs in cpus to buf (MAXLINE bytes) as a list like
+ *    "0-3,6", and return buf
+ */
+char *fmtcpus(cpu_set_t *cpus, char *buf) {
+    int cpu, last, len = 0;
+
+    buf[0] = '\0';
+    for (cpu = 0; cpu < CPU_SETSIZE && len < MAXLINE - 32; cpu++) {
+        if (!CPU_ISSET(cpu, cpus))
+            continue;
+        for (last = cpu; last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, cpus); last++)
+            ;
+        len += sprintf(&buf[len], (last > cpu) ? "%s%d-%d" : "%s%d", len > 0 ? "," : "", cpu, last);
+        cpu = last;
+    }
+    return buf;
+}
+
+/*
+ * closeexcept - Close every descriptor above stderr but the n in keep,
+ *    with one close_range per gap between them (keep is sorted first)
+ */
+void closeexcept(int *keep, int n) {
+    int i, j, fd, lo = 3;
+
+    for (i = 1; i < n; i++)
+        for (j = i; j > 0 && keep[j - 1] > keep[j]; j--)
+            fd = keep[j], keep[j] = keep[j - 1], keep[j - 1] = fd;
+    for (i = 0; i < n; i++) {
+        if (keep[i] > lo)
+            close_range(lo, keep[i] - 1, 0);
+        lo = keep[i] + 1;
+    }
+    close_range(lo, ~0U, 0);
+}
+
+#ifdef USE_SPAWN
+/*
+ * spawn_cmd - Start argv with posix_spawn (a vfork-style clone, so the cost
+ *    does not grow with the shell's size) in process group pgid, 0 meaning
+ *    a new group led by the child. The fd table fdv is installed through
+ *    spawn file actions (as in applyfds), the nkeep descriptors in keep
+ *    stay open in the child, and mask is its signal mask.
+ *    Returns the child's pid, or 0 if the command could not be started.
+ */
+pid_t spawn_cmd(char **argv, pid_t pgid, int fdv[3], int *keep, int nkeep, sigset_t *mask) {
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    pid_t pid;
+    int err, i, t;
+
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK);
+    posix_spawnattr_setpgroup(&attr, pgid);
+    posix_spawnattr_setsigmask(&attr, mask);
+
+    posix_spawn_file_actions_init(&actions);
+    for (i = 0; i < 3; i++) {
+        t = fdorder[i];
+        if (fdv[t] != -1 && fdv[t] != t)
+            posix_spawn_file_actions_adddup2(&actions, fdv[t], t);
+    }
+    // a dup2 onto itself clears close-on-exec
+    for (i = 0; i < nkeep; i++)
+        posix_spawn_file_actions_adddup2(&actions, keep[i], keep[i]);
+
+    err = posix_spawn(&pid, argv[0], &actions, &attr, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (err != 0) {
+        printf("%s: Command not found\n", argv[0]);
+        return 0;
+    }
+    return pid;
+}
+#endif
+
+/* 
+ * parseline - Parse the command line and build the argv array.
+ * 
+ * Characters enclosed in single quotes are treated as a single
+ * argument.  Return number of arguments parsed.
+ *
+ * The words, *argvp (NULL terminated) and *kindsp (the TK_ kind of each
+ * word) are allocated from arena, so there is no limit on the length of
+ * the line or the number of words, and no static state. The line is
+ * classified in one vectorized pass (see scanline); words are then cut
+ * at the next space or quote found in the bitmaps, and only the short
+ * words that start with an operator character (or "2"), and those that
+ * start with "<(" or ">(", are looked at again, to recognize the operators.
+ */
+int parseline(const char *cmdline, char ***argvp, unsigned char **kindsp, struct arena_t *arena) {
+    size_t len = strlen(cmdline);
+    size_t nmap = len / 64 + 1;  /* words in each bitmap */
+    char *buf = arenaalloc(arena, len + 1);  /* local copy of command line */
+    size_t maxargs = 16;        /* size of argv and kinds (doubled as needed) */
+    char **argv = arenaalloc(arena, maxargs * sizeof(*argv));
+    unsigned char *kinds = arenaalloc(arena, maxargs);
+    struct scan_t scan;
+    size_t i = 0, word;
+    int argc = 0;               /* number of args */
+
+    memcpy(buf, cmdline, len + 1);
+    if (len > 0)
+        buf[len - 1] = ' ';     /* replace trailing '\n' with space */
+    scan.spaces = arenaalloc(arena, 3 * nmap * sizeof(uint64_t));
+    scan.quotes = scan.spaces + nmap;
+    scan.ops = scan.quotes + nmap;
+    scanline(buf, len, &scan);
+
+    /* Build the argv list: a word ends at a space, or at the closing quote
+     * if it starts with one; an unterminated last word is dropped */
+    while (1) {
+        while (i < len && buf[i] == ' ') /* ignore spaces */
+            i++;
+        if (i < len && buf[i] == '\'') {
+            word = ++i;
+            i = nextbit(scan.quotes, i, len);
+        } else {
+            word = i;
+            i = nextbit(scan.spaces, i, len);
+        }
+        if (i == len)
+            break;
+        buf[i++] = '\0';
+        if (argc + 1 == (int)maxargs) {
+            char **grown = arenaalloc(arena, 2 * maxargs * sizeof(*argv));
+            unsigned char *kgrown = arenaalloc(arena, 2 * maxargs);
+            memcpy(grown, argv, argc * sizeof(*argv));
+            memcpy(kgrown, kinds, argc);
+            argv = grown;
+            kinds = kgrown;
+            maxargs *= 2;
+        }
+        kinds[argc] = TK_WORD;
+        if ((i - word <= 5 || buf[word + 1] == '(') && ((scan.ops[word / 64] >> (word % 64) & 1) || buf[word] == '2'))
+            kinds[argc] = opkind(&buf[word]);  // a short word (or "<(...") starting like an operator
+        argv[argc++] = &buf[word];
+    }
+    argv[argc] = NULL;
+    kinds[argc] = TK_WORD;
+    *argvp = argv;
+    *kindsp = kinds;
+    
+    return argc;
+}
+
+/*
+ * opkind - The TK_ kind of a word that starts with an operator character
+ *    (or '2'): |, |+, <, <<, <<<, >, >>, 2>, 2>>, 2>&1 and &, the start of a
+ *    process substitution <( or >(, or TK_WORD
+ */
+int opkind(const char *word) {
+    switch (word[0]) {
+        case '|':
+            if (word[1] == '\0')
+                return TK_PIPE;
+            return (word[1] == '+' && word[2] == '\0') ? TK_FANOUT : TK_WORD;
+        case '<':
+            if (word[1] == '\0')
+                return TK_IN;
+            if (word[1] == '(')
+                return TK_PSUBIN;
+            if (word[1] != '<')
+                return TK_WORD;
+            if (word[2] == '\0')
+                return TK_HEREDOC;
+            return (word[2] == '<' && word[3] == '\0') ? TK_HERESTR : TK_WORD;
+        case '&': return (word[1] == '\0') ? TK_BG : TK_WORD;
+        case '>':
+            if (word[1] == '\0')
+                return TK_OUT;
+            if (word[1] == '(')
+                return TK_PSUBOUT;
+            return (word[1] == '>' && word[2] == '\0') ? TK_APPEND : TK_WORD;
+        case '2':
+            if (word[1] != '>')
+                return TK_WORD;
+            if (word[2] == '\0')
+                return TK_ERR;
+            if (word[2] == '>' && word[3] == '\0')
+                return TK_ERRAPPEND;
+            if (word[2] == '&' && word[3] == '1' && word[4] == '\0')
+                return TK_ERRDUP;
+    }
+    return TK_WORD;
+}
+
+/*
+ * arenaalloc - Allocate n bytes (aligned for any type) from arena. They
+ *    stay valid until the next arenareset.
+ */
+void *arenaalloc(struct arena_t *arena, size_t n) {
+    struct chunk_t *chunk = arena->chunks;
+    size_t size;
+
+    n = (n + 15) & ~(size_t)15;
+    if (chunk == NULL || chunk->size - chunk->used < n) {
+        size = (chunk == NULL) ? ARENACHUNK : 2 * chunk->size;
+        while (size < n)
+            size *= 2;
+        if ((chunk = malloc(sizeof(*chunk) + size)) == NULL)
+            unix_error("arena error");
+        chunk->next = arena->chunks;
+        chunk->size = size;
+        chunk->used = 0;
+        arena->chunks = chunk;
+        arena->total += size;
+    }
+    chunk->used += n;
+    return &chunk->data[chunk->used - n];
+}
+
+/*
+ * arenareset - Free everything allocated from arena. If the last command
+ *    needed several chunks, they are replaced by one big enough for all
+ *    of them, so a steady stream of similar commands never calls malloc.
+ */
+void arenareset(struct arena_t *arena) {
+    struct chunk_t *chunk = arena->chunks;
+    size_t total = arena->total;
+
+    if (chunk != NULL && chunk->next != NULL) {
+        while (chunk != NULL) {
+            struct chunk_t *next = chunk->next;
+            free(chunk);
+            chunk = next;
+        }
+        if ((chunk = malloc(sizeof(*chunk) + total)) == NULL)
+            unix_error("arena error");
+        chunk->next = NULL;
+        chunk->size = total;
+        arena->chunks = chunk;
+    }
+    if (chunk != NULL)
+        chunk->used = 0;
+}
+
+/*
+ * initscan - Pick the fastest block scanner this CPU supports
+ */
+void initscan(void) {
+    scanblocks = scanblocks_scalar;
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        scanblocks = scanblocks_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        scanblocks = scanblocks_sse2;
+#endif
+}
+
+/*
+ * scanline - Classify every byte of buf[0..len) into the bitmaps of scan,
+ *    which must have len / 64 + 1 words each. The last partial block is
+ *    scanned from a zero-padded copy, so bits past len are never set.
+ */
+void scanline(const char *buf, size_t len, struct scan_t *scan) {
+    char tail[64];
+    size_t n = len / 64;
+
+    scanblocks(buf, n, scan->spaces, scan->quotes, scan->ops);
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, &buf[n * 64], len - n * 64);
+    scanblocks(tail, 1, &scan->spaces[n], &scan->quotes[n], &scan->ops[n]);
+}
+
+/* scanblocks_scalar - Classify 64-byte blocks one byte at a time */
+void scanblocks_scalar(const char *p, size_t n, uint64_t *spaces, uint64_t *quotes, uint64_t *ops) {
+    size_t b;
+    int i;
+
+    for (b = 0; b < n; b++, p += 64) {
+        uint64_t s = 0, q = 0, o = 0;
+        for (i = 0; i < 64; i++) {
+            switch (p[i]) {
+                case ' ':  s |= 1ULL << i; break;
+                case '\'': q |= 1ULL << i; break;
+                case '|': case '<': case '>': case '&':
+                    o |= 1ULL << i; break;
+            }
+        }
+        spaces[b] = s;
+        quotes[b] = q;
+        ops[b] = o;
+    }
+}
+
+#ifdef SCAN_X86
+/* scanblocks_sse2 - Classify 64-byte blocks 16 bytes at a time */
+__attribute__((target("sse2")))
+void scanblocks_sse2(const char *p, size_t n, uint64_t *spaces, uint64_t *quotes, uint64_t *ops) {
+    const __m128i sp = _mm_set1_epi8(' '), qu = _mm_set1_epi8('\''), pi = _mm_set1_epi8('|');
+    const __m128i lt = _mm_set1_epi8('<'), gt = _mm_set1_epi8('>'), am = _mm_set1_epi8('&');
+    size_t b;
+    int i;
+
+    for (b = 0; b < n; b++, p += 64) {
+        uint64_t s = 0, q = 0, o = 0;
+        for (i = 0; i < 64; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)&p[i]);
+            __m128i op = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, pi), _mm_cmpeq_epi8(v, lt)),
+                                      _mm_or_si128(_mm_cmpeq_epi8(v, gt), _mm_cmpeq_epi8(v, am)));
+            s |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, sp)) << i;
+            q |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, qu)) << i;
+            o |= (uint64_t)(uint16_t)_mm_movemask_epi8(op) << i;
+        }
+        spaces[b] = s;
+        quotes[b] = q;
+        ops[b] = o;
+    }
+}
+
+/* scanblocks_avx2 - Classify 64-byte blocks 32 bytes at a time */
+__attribute__((target("avx2")))
+void scanblocks_avx2(const char *p, size_t n, uint64_t *spaces, uint64_t *quotes, uint64_t *ops) {
+    const __m256i sp = _mm256_set1_epi8(' '), qu = _mm256_set1_epi8('\''), pi = _mm256_set1_epi8('|');
+    const __m256i lt = _mm256_set1_epi8('<'), gt = _mm256_set1_epi8('>'), am = _mm256_set1_epi8('&');
+    size_t b;
+    int i;
+
+    for (b = 0; b < n; b++, p += 64) {
+        uint64_t s = 0, q = 0, o = 0;
+        for (i = 0; i < 64; i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)&p[i]);
+            __m256i op = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, pi), _mm256_cmpeq_epi8(v, lt)),
+                                         _mm256_or_si256(_mm256_cmpeq_epi8(v, gt), _mm256_cmpeq_epi8(v, am)));
+            s |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, sp)) << i;
+            q |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, qu)) << i;
+            o |= (uint64_t)(uint32_t)_mm256_movemask_epi8(op) << i;
+        }
+        spaces[b] = s;
+        quotes[b] = q;
+        ops[b] = o;
+    }
+}
+#endif
+
+/*
+ * nextbit - Return the position of the first bit set in map at or after
+ *    i, or n if there is none before n
+ */
+size_t nextbit(const uint64_t *map, size_t i, size_t n) {
+    size_t w = i / 64;
+    uint64_t bits;
+
+    if (i >= n)
+        return n;
+    bits = map[w] & (~0ULL << (i % 64));
+    while (bits == 0) {
+        if (++w * 64 >= n)
+            return n;
+        bits = map[w];
+    }
+    i = w * 64 + __builtin_ctzll(bits);
+    return (i < n) ? i : n;
+}
+
+/* 
+ * builtin_cmd - If the user has typed a built-in command then execute
+ *    it immediately.  
+ */
+int builtin_cmd(char **argv) {
+
+    if(strcmp(argv[0], "quit") == 0) {
+        exit(1);
+    }
+    if(strcmp(argv[0], "jobs") == 0) {
+        // jobs -l also shows the resource usage of each job
+        listjobs(&jobs, argv[1] != NULL && strcmp(argv[1], "-l") == 0);
+        return 1;
+    }
+
+    int res_bg = strcmp(argv[0], "bg");
+    int res_fg = strcmp(argv[0], "fg");
+
+    if(res_fg == 0 || res_bg == 0) {
+        do_bgfg(argv);
+        return 1;
+    }
+    if(strcmp(argv[0], "parallel") == 0) {
+        do_parallel(argv);
+        return 1;
+    }
+    if(strcmp(argv[0], "cache") == 0) {
+        do_cache(argv);
+        return 1;
+    }
+    if(strcmp(argv[0], "ulimit") == 0) {
+        do_ulimit(argv);
+        return 1;
+    }
+    struct util_t *util;
+    if(!strict && (util = getutil(argv[0])) != NULL) {
+        fflush(stderr);
+        bstatus = util->run(argv);
+        return 1;
+    }
+
+    return 0;     /* not a builtin command */
+    
+}
+
+/* 
+ * do_bgfg - Execute the builtin bg and fg commands
+ */
+void do_bgfg(char **argv) {
+    pid_t pid;
+    int jid;
+    int argc = 0;
+    struct job_t *job;
+
+    while (argv[argc] != NULL) {
+        argc++;
+    }
+    if (!strcmp(argv[0], "bg")) {
+        // error checks
+        if (argc != 2) {
+            printf("bg command requires PID or %%jid argument\n");
+            return;
+        }
+        // case_1: second arg = %jid
+        if (argv[1][0] == '%') {
+            if (argv[1][1] == '\0' || !isdigit(argv[1][1])) {
+                printf("%s: No such job\n", argv[1]);
+                return;
+            }
+            jid = atol(&argv[1][1]);
+            if ((job = getjobjid(&jobs, jid)) == NULL) {
+                printf("%s: No such job\n", argv[1]);
+                return;
+            }
+            resumejob(job, BG);
+            printf("[%d] (%d) %s", jid, job->pid, job->cmdline);
+            return;
+        }
+        // case_2: second arg = PID
+        if (!isdigit(argv[1][0])) {
+            printf("bg: argument must be a PID or %%jid\n");
+            return;
+        }
+        pid = atol(argv[1]);
+        if ((job = getjobpid(&jobs, pid)) == NULL) {
+            printf("(%d): No such process\n", pid);
+            return;
+        }
+        resumejob(job, BG);
+        printf("[%d] (%d) %s", job->jid, pid, job->cmdline);
+        return;
+
+
+    } else if (!strcmp(argv[0], "fg")) {
+        // error checks
+        if (argc != 2) {
+            printf("fg command requires PID or %%jid argument\n");
+            return;
+        }
+        // case_1: second arg = %jid
+        if (argv[1][0] == '%') {
+            if (argv[1][1] == '\0' || !isdigit(argv[1][1])) {
+                printf("%s: No such job\n", argv[1]);
+                return;
+            }
+            jid = atol(&argv[1][1]);
+            if ((job = getjobjid(&jobs, jid)) == NULL) {
+                printf("%s: No such job\n", argv[1]);
+                return;
+            }
+            resumejob(job, FG);
+            waitfg(job->pid);
+            return;
+        }
+        // case_2: second arg = PID
+        if (!isdigit(argv[1][0])) {
+            printf("fg: argument must be a PID or %%jid\n");
+            return;
+        }
+        pid = atol(argv[1]);
+        if ((job = getjobpid(&jobs, pid)) == NULL) {
+            printf("(%d): No such process\n", pid);
+            return;
+        }
+        resumejob(job, FG);
+        waitfg(job->pid);
+        return;
+    }
+
+    return;
+}
+
+/*
+ * do_parallel - Execute the builtin parallel command:
+ *    parallel [-j N] cmd [args...] ::: item...
+ *    Runs "cmd args... item" for every item as a background job, with at
+ *    most N (default: the number of CPUs) running at once. The next item
+ *    is started as soon as a running one is reaped (see finishproc). Once
+ *    an item is stopped, no more are started, and when none is left
+ *    running the stopped ones are left in the job list.
+ */
+void do_parallel(char **argv) {
+    long maxjobs = sysconf(_SC_NPROCESSORS_ONLN);
+    char *end;
+    int i = 1, sep;
+
+    if (argv[1] != NULL && strcmp(argv[1], "-j") == 0) {
+        if (argv[2] == NULL || (maxjobs = strtol(argv[2], &end, 10)) < 1 || *end != '\0') {
+            printf("parallel: -j requires a positive number of jobs\n");
+            return;
+        }
+        i = 3;
+    }
+    for (sep = i; argv[sep] != NULL && strcmp(argv[sep], ":::") != 0; sep++)
+        ;
+    if (sep == i || argv[sep] == NULL) {
+        printf("parallel command requires a command and ::: arguments\n");
+        return;
+    }
+    // items are started as jobs, which cannot act on the shell's own jobs
+    if (!strcmp(argv[i], "fg") || !strcmp(argv[i], "bg") || !strcmp(argv[i], "parallel")) {
+        printf("%s: job control commands cannot be run by parallel\n", argv[i]);
+        return;
+    }
+    argv[sep] = NULL;
+    par.argv = &argv[i];
+    par.argc = sep - i;
+    par.items = &argv[sep + 1];
+    for (par.nitems = 0; par.items[par.nitems] != NULL; par.nitems++)
+        ;
+    par.next = 0;
+    par.running = 0;
+    par.maxjobs = maxjobs;
+    par.failed = 0;
+    par.stopped = 0;
+    par.halted = 0;
+
+    while (par.next < par.nitems && par.running < par.maxjobs)
+        startitem();
+    while (par.running > par.stopped)
+        runevents(-1);
+    flushreports();
+    if (par.stopped > 0) {
+        // what is left of the run becomes ordinary jobs, for fg and bg
+        for (i = 0; i < jobs.maxjobs; i++)
+            if (jobs.byjid[i] != NULL)
+                jobs.byjid[i]->item = 0;
+        printf("parallel: stopped, %d of %d items not started\n", par.nitems - par.next, par.nitems);
+    }
+    if (par.failed > 0)
+        printf("parallel: %d of %d items failed\n", par.failed, par.nitems);
+    par.argv = NULL;
+}
+
+/*
+ * runbuiltin - Run the single stage of plan with builtin_cmd, in the shell
+ *    itself, with its redirections applied to the shell's own fds for the
+ *    time of the command. The output of jobs > file is written straight
+ *    to the file.
+ */
+void runbuiltin(struct plan_t *plan) {
+    struct stage_t *stage = &plan->stages[0];
+    int *opened = arenaalloc(&cmdarena, (stage->nredirs + 1) * sizeof(*opened));
+    int nopened = 0;
+    int rv[3], fdv[3], saved[3];
+    char **argv;
+    int argc;
+
+    // builtins may rewrite their argv, and a cached plan must stay intact
+    for (argc = 0; stage->argv[argc] != NULL; argc++)
+        ;
+    argv = arenaalloc(&cmdarena, (argc + 1) * sizeof(*argv));
+    memcpy(argv, stage->argv, (argc + 1) * sizeof(*argv));
+    if (openredirs(stage, plan->docs, rv, opened, &nopened) < 0) {
+        closefds(opened, nopened);
+        return;
+    }
+    stagefds(rv, -1, -1, fdv);
+    fflush(stdout);
+    if (applyfds(fdv, saved) < 0)
+        perror("dup2");
+    else
+        builtin_cmd(argv);
+    fflush(stdout);
+    restorefds(saved);
+    closefds(opened, nopened);
+}
+
+/*
+ * do_cache - Execute the builtin cache command: show the plan cache
+ *    counters, or with -c empty the cache and reset them
+ */
+void do_cache(char **argv) {
+    if (argv[1] != NULL && strcmp(argv[1], "-c") == 0) {
+        clearcache();
+        plancache.hits = plancache.misses = 0;
+        return;
+    }
+    if (argv[1] != NULL) {
+        printf("cache: usage: cache [-c]\n");
+        return;
+    }
+    printf("plan cache: %d/%d lines, %lu hits, %lu misses\n",
+           plancache.nlines, CACHESIZE, plancache.hits, plancache.misses);
+}
+
+/*
+ * do_ulimit - Execute the builtin ulimit command: show (all of them, or
+ *    the ones named by option) or set the resource limits every job
+ *    starts with. A value sets the soft and the hard limit, or only the
+ *    one chosen by -S or -H. The shell's own limits are left alone.
+ */
+void do_ulimit(char **argv) {
+    struct rlimit rl, own;
+    int mode = 0;               // 'S' or 'H' once -S or -H is given
+    int all = 0, shown = 0;
+    char buf[32];
+    rlim_t v;
+    int i, k;
+
+    for (k = 1; argv[k] != NULL; k++) {
+        char *a = argv[k];
+        if (!strcmp(a, "-S") || !strcmp(a, "-H")) {
+            mode = a[1];
+            continue;
+        }
+        if (!strcmp(a, "-a")) {
+            all = 1;
+            continue;
+        }
+        if (a[0] != '-' || a[1] == '\0' || a[2] != '\0' || (i = findlimit(a[1], NULL, 0)) < 0) {
+            printf("ulimit: usage: ulimit [-S|-H] [-a] [-cdflnstuv [VALUE|unlimited]]...\n");
+            return;
+        }
+        getlimit(&shlimits, i, &rl);
+        shown = 1;
+        if (argv[k + 1] == NULL || argv[k + 1][0] == '-') {
+            printf("%s\n", fmtlimit(mode == 'H' ? rl.rlim_max : rl.rlim_cur, i, buf));
+            continue;
+        }
+        if (parselimit(argv[++k], i, &v) < 0) {
+            printf("ulimit: -%c: %s: not a number\n", a[1], argv[k]);
+            return;
+        }
+        if (mode != 'H')
+            rl.rlim_cur = v;
+        if (mode != 'S')
+            rl.rlim_max = v;
+        if (rl.rlim_cur > rl.rlim_max) {
+            printf("ulimit: -%c: soft limit above the hard limit\n", a[1]);
+            return;
+        }
+        // only a privileged process may raise a hard limit
+        getrlimit(limitinfo[i].resource, &own);
+        if (rl.rlim_max > own.rlim_max && geteuid() != 0) {
+            printf("ulimit: -%c: cannot raise the hard limit above %s\n", a[1], fmtlimit(own.rlim_max, i, buf));
+            return;
+        }
+        setlimit(&shlimits, i, &rl);
+    }
+    if (!all && shown)
+        return;
+    for (i = 0; i < NLIMITS; i++) {
+        getlimit(&shlimits, i, &rl);
+        printf("%-24s (-%c) %s\n", limitinfo[i].desc, limitinfo[i].opt,
+               fmtlimit(mode == 'H' ? rl.rlim_max : rl.rlim_cur, i, buf));
+    }
+}
+
+/*
+ * startitem - Start the next item of the parallel builtin as a background job
+ */
+void startitem(void) {
+    char **argv = malloc((par.argc + 2) * sizeof(*argv));
+    struct stage_t stage = { .argv = argv, .inshell = isbuiltin(par.argv[0]) || (!strict && getutil(par.argv[0]) != NULL) };
+    struct plan_t plan = { .argv = argv, .argc = par.argc + 1, .nstages = 1, .stages = &stage, .nall = 1 };
+    char *cmdline = NULL;
+    size_t len = 1;
+    int i, item = ++par.next;
+    pid_t pgid = 0;
+
+    if (argv != NULL) {
+        for (i = 0; i < par.argc; i++)
+            argv[i] = par.argv[i];
+        argv[i++] = par.items[item - 1];
+        argv[i] = NULL;
+        for (i = 0; argv[i] != NULL; i++)
+            len += strlen(argv[i]) + 1;
+        cmdline = malloc(len);
+    }
+    if (cmdline != NULL) {
+        // the job's command line is its words joined by spaces
+        for (i = 0, len = 0; argv[i] != NULL; i++)
+            len += sprintf(&cmdline[len], "%s%s", argv[i], argv[i + 1] != NULL ? " " : "\n");
+        pgid = startjob(&plan, BG, cmdline, NULL, NULL);
+    } else {
+        perror("malloc");
+    }
+    if (pgid != 0) {
+        getjobpid(&jobs, pgid)->item = item;
+        par.running++;
+    } else {
+        // reported as a child that could not exec would be (with no pid),
+        // right after the error that startjob printed
+        report("[%d/%d] (0) Exit 1 %s", item, par.nitems, cmdline != NULL ? cmdline : "\n");
+        flushreports();
+        par.failed++;
+    }
+    free(cmdline);
+    free(argv);
+}
+
+/*****************
+ * In-process utilities
+ *****************/
+
+/*
+ * getutil - Find the in-process utility called name (or /bin/name or
+ *    /usr/bin/name), or return NULL
+ */
+struct util_t *getutil(char *name) {
+    static struct util_t utils[] = {
+        { "echo", util_echo }, { "printf", util_printf }, { "test", util_test },
+        { "[", util_test }, { "true", util_true }, { "false", util_false }, { NULL, NULL }
+    };
+    int i;
+
+    if (strncmp(name, "/bin/", 5) == 0)
+        name += 5;
+    else if (strncmp(name, "/usr/bin/", 9) == 0)
+        name += 9;
+    for (i = 0; utils[i].name != NULL; i++)
+        if (strcmp(name, utils[i].name) == 0)
+            return &utils[i];
+    return NULL;
+}
+
+/* util_true - true: do nothing, successfully */
+int util_true(char **argv) {
+    (void)argv;
+    return 0;
+}
+
+/* util_false - false: do nothing, unsuccessfully */
+int util_false(char **argv) {
+    (void)argv;
+    return 1;
+}
+
+/*
+ * util_echo - echo [-neE] [string...]: print the strings separated by
+ *    spaces (-n: without the newline, -e: expanding backslash escapes)
+ */
+int util_echo(char **argv) {
+    int newline = 1, escapes = 0;
+    char *p;
+    int i;
+
+    // options, as long as each word is made only of n, e and E
+    for (i = 1; argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0'
+                && strspn(&argv[i][1], "neE") == strlen(&argv[i][1]); i++) {
+        for (p = &argv[i][1]; *p != '\0'; p++) {
+            if (*p == 'n')
+                newline = 0;
+            else
+                escapes = (*p == 'e');
+        }
+    }
+    for (; argv[i] != NULL; i++) {
+        if (!escapes)
+            fputs(argv[i], stdout);
+        else if (putescapes(argv[i]) < 0)
+            return 0;  // \c: no further output
+        if (argv[i + 1] != NULL)
+            putchar(' ');
+    }
+    if (newline)
+        putchar('\n');
+    return 0;
+}
+
+/*
+ * util_printf - printf format [argument...]: print the arguments under the
+ *    control of format, which is reused until they are all consumed
+ */
+int util_printf(char **argv) {
+    char **args, **first;
+    char spec[64], *end;
+    const char *f;
+    int status = 0, n, c;
+
+    if (argv[1] == NULL) {
+        fprintf(stderr, "%s: missing operand\n", argv[0]);
+        return 1;
+    }
+    args = &argv[2];
+    do {
+        first = args;
+        for (f = argv[1]; *f != '\0'; ) {
+            if (*f == '\\') {
+                f = unescape(f, 0, &c);
+                if (c < 0)
+                    return status;
+                putchar(c);
+                continue;
+            }
+            if (*f != '%') {
+                putchar(*f++);
+                continue;
+            }
+            if (f[1] == '%') {
+                putchar('%');
+                f += 2;
+                continue;
+            }
+            // copy the flags, width and precision, taking "*" from the arguments
+            spec[0] = '%';
+            n = 1;
+            for (f++; *f != '\0' && strchr("-+ #0", *f) != NULL && n < 8; f++)
+                spec[n++] = *f;
+            for (c = 0; c < 2; c++) {
+                if (c == 1) {
+                    if (*f != '.')
+                        break;
+                    spec[n++] = *f++;
+                }
+                if (*f == '*') {
+                    n += sprintf(&spec[n], "%d", *args != NULL ? atoi(*args++) : 0);
+                    f++;
+                } else {
+                    while (isdigit((unsigned char)*f) && n < 40)
+                        spec[n++] = *f++;
+                }
+            }
+            char *arg = (*args != NULL) ? *args++ : NULL;
+            switch (*f) {
+                case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+                case 'c':
+                case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+                    if (*f == 'c') {
+                        strcpy(&spec[n], "c");
+                        if (arg != NULL && *arg != '\0')
+                            printf(spec, *arg);
+                    } else if (strchr("eEfFgGaA", *f) != NULL) {
+                        double v = 0;
+                        if (arg != NULL && (v = strtod(arg, &end), end == arg || *end != '\0')) {
+                            fprintf(stderr, "%s: '%s': expected a numeric value\n", argv[0], arg);
+                            status = 1;
+                        }
+                        sprintf(&spec[n], "%c", *f);
+                        printf(spec, v);
+                    } else {
+                        long long v = 0;
+                        if (arg != NULL && (arg[0] == '\'' || arg[0] == '"')) {
+                            v = (unsigned char)arg[1];
+                        } else if (arg != NULL && (v = (long long)strtoull(arg, &end, 0), end == arg || *end != '\0')) {
+                            fprintf(stderr, "%s: '%s': expected a numeric value\n", argv[0], arg);
+                            status = 1;
+                        }
+                        if (*f == 'd' || *f == 'i') {
+                            if (arg != NULL && arg[0] != '\'' && arg[0] != '"')
+                                v = strtoll(arg, NULL, 0);
+                            sprintf(&spec[n], "ll%c", *f);
+                            printf(spec, v);
+                        } else {
+                            sprintf(&spec[n], "ll%c", *f);
+                            printf(spec, (unsigned long long)v);
+                        }
+                    }
+                    break;
+                case 's':
+                    strcpy(&spec[n], "s");
+                    printf(spec, arg != NULL ? arg : "");
+                    break;
+                case 'b':
+                    // the argument with its backslash escapes expanded
+                    if (arg != NULL && putescapes(arg) < 0)
+                        return status;
+                    break;
+                default:
+                    if (*f == '\0')
+                        fprintf(stderr, "%s: %s: missing conversion specifier\n", argv[0], argv[1]);
+                    else
+                        fprintf(stderr, "%s: %%%c: invalid conversion specification\n", argv[0], *f);
+                    return 1;
+            }
+            f++;
+        }
+    } while (*args != NULL && args != first);
+    return status;
+}
+
+/*
+ * putescapes - Print s, expanding its backslash escapes (octal is \0NNN).
+ *    Returns -1 if it stopped at \c, else 0.
+ */
+int putescapes(const char *s) {
+    int c;
+
+    while (*s != '\0') {
+        if (*s != '\\') {
+            putchar(*s++);
+            continue;
+        }
+        s = unescape(s, 1, &c);
+        if (c < 0)
+            return -1;
+        putchar(c);
+    }
+    return 0;
+}
+
+/*
+ * unescape - Decode the backslash escape at s into *c (-1 for \c) and
+ *    return what follows it. Octal escapes are \0NNN if zero is set (echo,
+ *    printf %b) and \NNN otherwise (printf formats). An unknown escape
+ *    decodes to the backslash itself.
+ */
+const char *unescape(const char *s, int zero, int *c) {
+    static const char from[] = "\\abefnrtv", to[] = "\\\a\b\033\f\n\r\t\v";
+    const char *p;
+    int n, v;
+
+    s++;
+    if (*s != '\0' && (p = strchr(from, *s)) != NULL) {
+        *c = to[p - from];
+        return s + 1;
+    }
+    if (*s == 'c') {
+        *c = -1;
+        return s + 1;
+    }
+    if (*s == 'x' && isxdigit((unsigned char)s[1])) {
+        for (s++, v = 0, n = 0; n < 2 && isxdigit((unsigned char)*s); n++, s++)
+            v = 16 * v + (isdigit((unsigned char)*s) ? *s - '0' : tolower((unsigned char)*s) - 'a' + 10);
+        *c = v;
+        return s;
+    }
+    if (*s >= '0' && *s <= '7') {
+        if (zero && *s == '0')
+            s++;
+        for (v = 0, n = 0; n < 3 && *s >= '0' && *s <= '7'; n++, s++)
+            v = 8 * v + (*s - '0');
+        *c = v & 0xff;
+        return s;
+    }
+    *c = '\\';
+    return s;
+}
+
+/* The words of the test expression being evaluated */
+static char **targv;        /* the operands of test */
+static int tpos, tend;      /* next word to parse, end of the words */
+static int terror;          /* set when the expression is malformed */
+
+/*
+ * util_test - test expression / [ expression ]: exit 0 if the expression
+ *    is true, 1 if it is false and 2 if it is malformed
+ */
+int util_test(char **argv) {
+    char *name = strrchr(argv[0], '/') ? strrchr(argv[0], '/') + 1 : argv[0];
+    int r;
+
+    for (tend = 0; argv[tend] != NULL; tend++)
+        ;
+    if (strcmp(name, "[") == 0) {
+        if (strcmp(argv[tend - 1], "]") != 0) {
+            fprintf(stderr, "%s: missing ']'\n", argv[0]);
+            return 2;
+        }
+        tend--;
+    }
+    if (tend == 1)
+        return 1;
+    targv = argv;
+    tpos = 1;
+    terror = 0;
+    r = testexpr();
+    if (!terror && tpos < tend) {
+        fprintf(stderr, "%s: extra argument '%s'\n", targv[0], targv[tpos]);
+        terror = 1;
+    }
+    return terror ? 2 : !r;
+}
+
+/* testexpr - expr: and ["-o" expr] */
+int testexpr(void) {
+    int r = testand();
+
+    while (!terror && tpos < tend && strcmp(targv[tpos], "-o") == 0) {
+        tpos++;
+        r = testand() || r;
+    }
+    return r;
+}
+
+/* testand - and: not ["-a" and] */
+int testand(void) {
+    int r = testnot();
+
+    while (!terror && tpos < tend && strcmp(targv[tpos], "-a") == 0) {
+        tpos++;
+        r = testnot() && r;
+    }
+    return r;
+}
+
+/* testnot - not: "!" not | primary (a binary operator takes precedence) */
+int testnot(void) {
+    if (tend - tpos >= 2 && strcmp(targv[tpos], "!") == 0
+            && !(tend - tpos == 3 && testbinary(NULL, targv[tpos + 1], NULL) >= 0)) {
+        tpos++;
+        return !testnot();
+    }
+    return testprimary();
+}
+
+/* testprimary - primary: a op b | "(" expr ")" | -op a | string */
+int testprimary(void) {
+    int left = tend - tpos, r;
+
+    if (left <= 0) {
+        fprintf(stderr, "%s: missing argument after '%s'\n", targv[0], targv[tpos - 1]);
+        terror = 1;
+        return 0;
+    }
+    if (left >= 3 && testbinary(NULL, targv[tpos + 1], NULL) >= 0) {
+        tpos += 3;
+        return testbinary(targv[tpos - 3], targv[tpos - 2], targv[tpos - 1]);
+    }
+    if (left >= 2 && strcmp(targv[tpos], "(") == 0) {
+        tpos++;
+        r = testexpr();
+        if (!terror && (tpos >= tend || strcmp(targv[tpos], ")") != 0)) {
+            fprintf(stderr, "%s: ')' expected\n", targv[0]);
+            terror = 1;
+        }
+        tpos++;
+        return r;
+    }
+    if (left >= 2 && testunary(targv[tpos], NULL) >= 0) {
+        tpos += 2;
+        return testunary(targv[tpos - 2], targv[tpos - 1]);
+    }
+    return targv[tpos++][0] != '\0';
+}
+
+/*
+ * testbinary - Evaluate a op b. With a == NULL, only tell whether op is
+ *    a binary operator (0) or not (-1).
+ */
+int testbinary(char *a, char *op, char *b) {
+    static char *ops[] = { "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le",
+                           "-gt", "-ge", "-nt", "-ot", "-ef", NULL };
+    struct stat sa, sb;
+    long long x, y;
+    int i, ok;
+
+    for (i = 0; ops[i] != NULL && strcmp(op, ops[i]) != 0; i++)
+        ;
+    if (ops[i] == NULL)
+        return -1;
+    if (a == NULL)
+        return 0;
+    if (i <= 4) {
+        int d = strcmp(a, b);
+        return (i <= 1) ? d == 0 : (i == 2) ? d != 0 : (i == 3) ? d < 0 : d > 0;
+    }
+    if (i <= 10) {
+        x = testint(a);
+        y = testint(b);
+        switch (i) {
+            case 5:  return x == y;
+            case 6:  return x != y;
+            case 7:  return x < y;
+            case 8:  return x <= y;
+            case 9:  return x > y;
+            default: return x >= y;
+        }
+    }
+    ok = (stat(a, &sa) == 0);
+    if (stat(b, &sb) != 0)
+        return i == 11 && ok;  // a file is newer than a missing one
+    if (!ok)
+        return i == 12;
+    if (i == 13)
+        return sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+    if (sa.st_mtim.tv_sec != sb.st_mtim.tv_sec)
+        return (i == 11) == (sa.st_mtim.tv_sec > sb.st_mtim.tv_sec);
+    return (i == 11) ? sa.st_mtim.tv_nsec > sb.st_mtim.tv_nsec : sa.st_mtim.tv_nsec < sb.st_mtim.tv_nsec;
+}
+
+/*
+ * testunary - Evaluate op a. With a == NULL, only tell whether op is a
+ *    unary operator (0) or not (-1).
+ */
+int testunary(char *op, char *a) {
+    struct stat st;
+
+    if (op[0] != '-' || op[1] == '\0' || op[2] != '\0' || strchr("nzefdrwxsLhbcpSgukt", op[1]) == NULL)
+        return -1;
+    if (a == NULL)
+        return 0;
+    switch (op[1]) {
+        case 'n': return a[0] != '\0';
+        case 'z': return a[0] == '\0';
+        case 'r': return access(a, R_OK) == 0;
+        case 'w': return access(a, W_OK) == 0;
+        case 'x': return access(a, X_OK) == 0;
+        case 't': return isatty((int)testint(a));
+        case 'L':
+        case 'h': return lstat(a, &st) == 0 && S_ISLNK(st.st_mode);
+    }
+    if (stat(a, &st) != 0)
+        return 0;
+    switch (op[1]) {
+        case 'f': return S_ISREG(st.st_mode);
+        case 'd': return S_ISDIR(st.st_mode);
+        case 's': return st.st_size > 0;
+        case 'b': return S_ISBLK(st.st_mode);
+        case 'c': return S_ISCHR(st.st_mode);
+        case 'p': return S_ISFIFO(st.st_mode);
+        case 'S': return S_ISSOCK(st.st_mode);
+        case 'g': return (st.st_mode & S_ISGID) != 0;
+        case 'u': return (st.st_mode & S_ISUID) != 0;
+        case 'k': return (st.st_mode & S_ISVTX) != 0;
+        default:  return 1;  // -e
+    }
+}
+
+/* testint - The integer operand s, or 0 (and an error) if it is not one */
+long long testint(char *s) {
+    char *end;
+    long long v = strtoll(s, &end, 10);
+
+    while (isspace((unsigned char)*end))
+        end++;
+    if (end == s || *end != '\0') {
+        if (!terror)
+            fprintf(stderr, "%s: invalid integer '%s'\n", targv[0], s);
+        terror = 1;
+    }
+    return v;
+}
+
+/* 
+ * waitfg - Block until process pid is no longer the foreground process
+ *
+ * A process's pidfd becomes readable the moment it exits, so the event
+ * loop wakes us for exactly the processes that finished; stops arrive
+ * through the signalfd as SIGCHLD.
+ */
+void waitfg(pid_t pid) {
+    struct job_t *job = getjobpid(&jobs, pid);
+
+    while (job != NULL && job->pid == pid && job->state == FG)
+        runevents(-1);
+    if (verbose) printf("waitfg: Process (%d) no longer the fg process\n", pid);
+    return;
+}
+
+/*****************
+ * Event loop
+ *****************/
+
+/*
+ * runevents - Wait up to timeout ms (-1 = forever) for events and handle
+ *    all of them: terminated job processes, signals and command input.
+ *    Child state changes are only collected while dispatching and are
+ *    applied to the job list as one batch at the end.
+ */
+void runevents(int timeout) {
+    struct epoll_event events[MAXEVENTS];
+    int i, n;
+
+    if ((n = epoll_wait(epfd, events, MAXEVENTS, timeout)) < 0) {
+        if (errno != EINTR)
+            unix_error("epoll_wait error");
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        if (events[i].data.u64 == EV_SIGNALS)
+            readsignals();
+        else if (events[i].data.u64 == EV_INPUT)
+            input.ready = 1;
+        else
+            reapproc(getproc(&jobs, events[i].data.u64));
+    }
+    applyevents();
+    // collect what the SIGCHLD scan had no room for (a pidfd left unread
+    // is simply reported again by the next epoll_wait)
+    while (evq.full) {
+        sigchld_handler(SIGCHLD);
+        applyevents();
+    }
+}
+
+/*
+ * readsignals - Drain the signalfd and run the handler of each signal
+ */
+void readsignals(void) {
+    struct signalfd_siginfo si[16];
+    ssize_t n;
+    int i;
+
+    while ((n = read(sigfd, si, sizeof(si))) > 0) {
+        for (i = 0; i < n / (ssize_t)sizeof(si[0]); i++) {
+            switch (si[i].ssi_signo) {
+                case SIGCHLD:
+                    sigchld_handler(SIGCHLD);
+                    break;
+                case SIGINT:
+                    sigint_handler(SIGINT);
+                    break;
+                case SIGTSTP:
+                    sigtstp_handler(SIGTSTP);
+                    break;
+                case SIGQUIT:
+                    sigquit_handler(SIGQUIT);
+                    break;
+            }
+        }
+    }
+}
+
+/*
+ * initinput - Read commands from fd. Pipes and terminals are watched by
+ *    the event loop; regular files (which epoll refuses) are always ready.
+ */
+void initinput(int fd) {
+    struct epoll_event ev = { .events = EPOLLONESHOT, .data.u64 = EV_INPUT };
+
+    input.fd = fd;
+    input.pollable = (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0);
+    input.size = INBUFSIZE;
+    if ((input.buf = malloc(input.size)) == NULL)
+        unix_error("initinput error");
+}
+
+/*
+ * readline - Copy the next line (with its '\n') from the input buffer
+ *    into memory allocated from arena, and point *cmdline at it.
+ *    Returns 1 on success, 0 if more input is needed and -1 at EOF.
+ */
+int readline(char **cmdline, struct arena_t *arena) {
+    char *start = &input.buf[input.start];
+    size_t avail = input.end - input.start;
+    char *nl = memchr(start, '\n', avail);
+    size_t len;
+
+    // like fgets followed by the feof check in main, an unterminated
+    // last line is dropped
+    if (nl == NULL)
+        return input.eof ? -1 : 0;
+    len = nl - start + 1;
+    *cmdline = arenaalloc(arena, len + 1);
+    memcpy(*cmdline, start, len);
+    (*cmdline)[len] = '\0';
+    input.start += len;
+    return 1;
+}
+
+/*
+ * waitinput - Run the event loop until the input is readable, then read
+ *    more of it into the input buffer
+ */
+void waitinput(void) {
+    ssize_t n;
+
+    // script output is only flushed when the shell is about to block
+    fflush(stdout);
+    if (input.pollable) {
+        // one-shot, so that the input does not wake waitfg while a job runs
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT, .data.u64 = EV_INPUT };
+        input.ready = 0;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, input.fd, &ev);
+        while (!input.ready)
+            runevents(-1);
+    }
+    memmove(input.buf, &input.buf[input.start], input.end - input.start);
+    input.end -= input.start;
+    input.start = 0;
+    if (input.end == input.size) {  // a line longer than the buffer
+        char *buf = realloc(input.buf, 2 * input.size);
+        if (buf == NULL)
+            unix_error("waitinput error");
+        input.buf = buf;
+        input.size *= 2;
+    }
+    while ((n = read(input.fd, &input.buf[input.end], input.size - input.end)) < 0) {
+        if (errno != EINTR && errno != EAGAIN)
+            app_error("read error");
+        if (errno == EAGAIN)
+            runevents(-1);
+    }
+    if (n == 0)
+        input.eof = 1;
+    input.end += n;
+}
+
+
+/*****************
+ * Signal handlers
+ *
+ * These run from the event loop (see readsignals), not in signal
+ * context, so they are free to print and to update the job list.
+ *****************/
+
+/* 
+ * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
+ *     a child job terminates (becomes a zombie), or stops because it
+ *     received a SIGSTOP or SIGTSTP signal. Stopped children are
+ *     collected here with waitid(WSTOPPED); terminated ones are reaped
+ *     by the event loop through their pidfds (see reapproc), so only the
+ *     processes that actually exited are touched. Either way the change
+ *     is only queued; the event loop applies it (see applyevents).
+ */
+void sigchld_handler(int sig) {
+    if (verbose) printf("sigchld_handler: entering\n");
+
+    siginfo_t info;
+
+    while (evq.n < MAXQUEUED) {
+        info.si_pid = 0;
+        if (waitid(P_ALL, 0, &info, WSTOPPED | WNOHANG) < 0 || info.si_pid == 0)
+            break;
+        pushevent(info.si_pid, waitstatus(&info), NULL);
+    }
+
+    while (evq.n < MAXQUEUED && jobs.unwatched > 0) {  // processes without a pidfd must be reaped the old way
+        struct rusage ru;
+        int status;
+        pid_t pid = wait4(-1, &status, WNOHANG, &ru);
+        if (pid <= 0)
+            break;
+        pushevent(pid, status, &ru);
+    }
+    // what did not fit is collected once the queue is applied (see runevents)
+    evq.full = (evq.n == MAXQUEUED);
+
+    if (verbose) printf("sigchld_handler: exiting\n");
+    return;
+}
+
+/* 
+ * sigint_handler - The kernel sends a SIGINT to the shell whenever the
+ *    user types ctrl-c at the keyboard.  Catch it and send it along
+ *    to the foreground job.  
+ */
+void sigint_handler(int sig) {
+    if (verbose) printf("sigint_handler: entering\n");
+    //Get job pid of the foreground job from Jobs
+    pid_t job_pid = fgpid(&jobs);
+    //If their is a job in the foreground then we kill the job
+    if(job_pid != 0){
+        if (verbose) printf("sigint_handler: Job [%d] (%d) killed\n", pid2jid(job_pid), job_pid);
+        int return_val = signaljob(getjobpid(&jobs, job_pid), SIGINT);
+        //error check in case process could not be killed
+        if(return_val == -1){
+            fprintf(stderr, "SIGINT Error: Job Could not be killed");
+        }
+    }
+    //The items of a running parallel command are its foreground: start no
+    //more of them and interrupt the ones running (continuing the stopped
+    //ones first, or they would never act on it)
+    else if(par.argv != NULL){
+        int i;
+        par.halted = 1;
+        for (i = 0; i < jobs.maxjobs; i++)
+            if (jobs.byjid[i] != NULL && jobs.byjid[i]->item > 0) {
+                if (jobs.byjid[i]->state == ST)
+                    resumejob(jobs.byjid[i], BG);
+                signaljob(jobs.byjid[i], SIGINT);
+            }
+    }
+    if (verbose) printf("sigint_handler: exiting\n");
+    return;
+}
+
+/*
+ * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
+ *     the user types ctrl-z at the keyboard. Catch it and suspend the
+ *     foreground job by sending it a SIGTSTP.  
+ */
+void sigtstp_handler(int sig) {
+    if (verbose) printf("sigtstp_handler: entering\n");
+
+    //Get job pid of the foreground jov
+    pid_t job_pid = fgpid(&jobs);
+
+    //If their is a job in the foreground then we stop the job
+    if(job_pid != 0){
+        if (verbose) printf("sigtstp_handler: Job [%d] (%d) stopped\n", pid2jid(job_pid), job_pid);
+
+        int return_val = signaljob(getjobpid(&jobs, job_pid), SIGTSTP);
+
+        if(return_val == -1){
+            fprintf(stderr, "SIGTSTOP Error: Job Could not be killed.");
+        }
+    }
+    //Stop every item of a running parallel command, and the command itself
+    else if(par.argv != NULL){
+        int i;
+        par.halted = 1;
+        for (i = 0; i < jobs.maxjobs; i++)
+            if (jobs.byjid[i] != NULL && jobs.byjid[i]->item > 0)
+                signaljob(jobs.byjid[i], SIGTSTP);
+    }
+    if (verbose) printf("sigtstp_handler: exiting\n");
+    return;
+}
+
+
+/*********************
+ * End signal handlers
+ *********************/
+
+/***********************************************
+ * Helper routines that manipulate the job list
+ **********************************************/
+
+/* clearjob - Clear the entries in a job struct */
+void clearjob(struct job_t *job) {
+    job->pid = 0;
+    job->pgid = 0;
+    job->jid = 0;
+    job->state = UNDEF;
+    job->nprocs = 0;
+    job->nlive = 0;
+    if (job->cmdline != NULL)
+        job->cmdline[0] = '\0';
+    job->timed = -1;
+    job->item = 0;
+    job->place.setcpus = 0;
+    job->place.node = -1;
+    job->place.cgroup = 0;
+    job->limits.set = 0;
+    job->cgfd = -1;
+    job->next = NULL;
+}
+
+/* initjobs - Initialize the job list */
+void initjobs(struct joblist_t *jobs) {
+    memset(jobs, 0, sizeof(*jobs));
+    if (!growjobs(jobs, INITJOBS) || !rehashjobs(jobs, INITJOBS))
+        unix_error("initjobs error");
+}
+
+/* growjobs - Make room for at least maxjobs JIDs; returns 0 if out of memory */
+int growjobs(struct joblist_t *jobs, int maxjobs) {
+    struct job_t **byjid;
+    unsigned long *jidmap;
+    int oldwords = jobs->maxjobs / JIDBITS;
+    int words = (maxjobs + JIDBITS - 1) / JIDBITS;
+
+    if ((byjid = realloc(jobs->byjid, words * JIDBITS * sizeof(*byjid))) == NULL)
+        return 0;
+    jobs->byjid = byjid;
+    if ((jidmap = realloc(jobs->jidmap, words * sizeof(*jidmap))) == NULL)
+        return 0;
+    jobs->jidmap = jidmap;
+    memset(&byjid[jobs->maxjobs], 0, (words * JIDBITS - jobs->maxjobs) * sizeof(*byjid));
+    memset(&jidmap[oldwords], 0, (words - oldwords) * sizeof(*jidmap));
+    jobs->maxjobs = words * JIDBITS;
+    return 1;
+}
+
+/* rehashjobs - Rebuild the PID hash with nbuckets (a power of 2) buckets */
+int rehashjobs(struct joblist_t *jobs, int nbuckets) {
+    struct proc_t **bypid;
+    int i, j;
+
+    if ((bypid = calloc(nbuckets, sizeof(*bypid))) == NULL)
+        return 0;
+    free(jobs->bypid);
+    jobs->bypid = bypid;
+    jobs->nbuckets = nbuckets;
+    for (i = 0; i < jobs->maxjobs; i++) {
+        struct job_t *job = jobs->byjid[i];
+        for (j = 0; job != NULL && j < job->nprocs; j++) {
+            struct proc_t *proc = &job->procs[j];
+            proc->hnext = bypid[pidhash(jobs, proc->pid)];
+            bypid[pidhash(jobs, proc->pid)] = proc;
+        }
+    }
+    return 1;
+}
+
+/* pidhash - Bucket of pid in the PID hash (Fibonacci hashing) */
+unsigned int pidhash(struct joblist_t *jobs, pid_t pid) {
+    return ((unsigned int)pid * 2654435761u) & (jobs->nbuckets - 1);
+}
+
+/* freejid - Returns smallest free job ID, growing the list if all are taken */
+int freejid(struct joblist_t *jobs) {
+    int w;
+    int words = jobs->maxjobs / JIDBITS;
+
+    for (w = 0; w < words; w++)
+        if (~jobs->jidmap[w] != 0)
+            return w * JIDBITS + __builtin_ctzl(~jobs->jidmap[w]) + 1;
+    if (!growjobs(jobs, 2 * jobs->maxjobs))
+        return 0;
+    return words * JIDBITS + 1;
+}
+
+/*
+ * addjob - Add a job made of the processes pids[0..nprocs-1] to the job
+ *    list. All of them are in the process group of pids[0].
+ */
+int addjob(struct joblist_t *jobs, pid_t *pids, int nprocs, int state, char *cmdline) {
+    struct job_t *job = NULL;
+    struct proc_t *procs;
+    int i;
+    
+    if (nprocs < 1 || pids[0] < 1)
+        return 0;
+    int free = freejid(jobs);
+    if (free && jobs->nprocs + nprocs > jobs->nbuckets) {
+        int nbuckets = jobs->nbuckets;
+        while (jobs->nprocs + nprocs > nbuckets)
+            nbuckets *= 2;
+        if (!rehashjobs(jobs, nbuckets))
+            free = 0;
+    }
+    // reuse a cleared record if there is one, so deletejob never has to free()
+    if (free && (job = jobs->freelist) != NULL)
+        jobs->freelist = job->next;
+    else if (free && (job = calloc(1, sizeof(*job))) == NULL)
+        free = 0;
+    if (free && job->maxprocs < nprocs) {
+        if ((procs = realloc(job->procs, nprocs * sizeof(*procs))) == NULL)
+            free = 0;
+        else {
+            job->procs = procs;
+            job->maxprocs = nprocs;
+        }
+    }
+    size_t cmdsize = strlen(cmdline) + 1;
+    if (free && job->cmdsize < cmdsize) {
+        char *buf = realloc(job->cmdline, cmdsize);
+        if (buf == NULL)
+            free = 0;
+        else {
+            job->cmdline = buf;
+            job->cmdsize = cmdsize;
+        }
+    }
+    if (!free && job != NULL) {
+        job->next = jobs->freelist;
+        jobs->freelist = job;
+    }
+    if (!free) {
+        printf("Tried to create too many jobs\n");
+        return 0;
+    }
+    clearjob(job);
+    job->pid = pids[0];
+    job->pgid = pids[0];
+    job->state = state;
+    job->jid = free;
+    job->nprocs = nprocs;
+    job->nlive = nprocs;
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+    strcpy(job->cmdline, cmdline);
+    jobs->byjid[free - 1] = job;
+    jobs->jidmap[(free - 1) / JIDBITS] |= 1UL << ((free - 1) % JIDBITS);
+    jobs->njobs++;
+    if (state == FG)
+        jobs->fg = job;
+    for (i = 0; i < nprocs; i++) {
+        struct proc_t *proc = &job->procs[i];
+        proc->pid = pids[i];
+        proc->state = PS_RUNNING;
+        proc->status = 0;
+        proc->job = job;
+        proc->hnext = jobs->bypid[pidhash(jobs, proc->pid)];
+        jobs->bypid[pidhash(jobs, proc->pid)] = proc;
+        jobs->nprocs++;
+        // watch each process through a pidfd (it stays valid even if the child is already a zombie)
+        struct epoll_event ev = { .events = EPOLLIN, .data.u64 = proc->pid };
+        if ((proc->pidfd = pidfd_open(proc->pid, 0)) < 0)
+            jobs->unwatched++;  /* sigchld_handler falls back to waitid(P_ALL) */
+        else
+            epoll_ctl(epfd, EPOLL_CTL_ADD, proc->pidfd, &ev);
+    }
+    if(verbose){
+        printf("Added job [%d] %d %s\n", job->jid, job->pid, job->cmdline);
+    }
+    return 1;
+}
+
+/* deletejob - Delete a job whose PID=pid from the job list */
+int deletejob(struct joblist_t *jobs, pid_t pid) {
+    struct proc_t **link;
+    struct job_t *job;
+    int i;
+
+    if ((job = getjobpid(jobs, pid)) == NULL)
+        return 0;
+
+    for (i = 0; i < job->nprocs; i++) {
+        struct proc_t *proc = &job->procs[i];
+        for (link = &jobs->bypid[pidhash(jobs, proc->pid)]; *link != NULL; link = &(*link)->hnext) {
+            if (*link == proc) {
+                *link = proc->hnext;
+                break;
+            }
+        }
+        jobs->nprocs--;
+        if (proc->state != PS_DONE && proc->pidfd != -1)
+            close(proc->pidfd);  /* also drops it from the epoll set */
+        else if (proc->state != PS_DONE)
+            jobs->unwatched--;
+    }
+    jobs->byjid[job->jid - 1] = NULL;
+    jobs->jidmap[(job->jid - 1) / JIDBITS] &= ~(1UL << ((job->jid - 1) % JIDBITS));
+    jobs->njobs--;
+    if (jobs->fg == job)
+        jobs->fg = NULL;
+    if (job->cgfd != -1)
+        dropcgroup(job->cgfd, job->cgid);
+    clearjob(job);
+    job->next = jobs->freelist;
+    jobs->freelist = job;
+    return 1;
+}
+
+/* fgpid - Return PID of current foreground job, 0 if no such job */
+pid_t fgpid(struct joblist_t *jobs) {
+    if (jobs->fg != NULL && jobs->fg->state == FG)
+        return jobs->fg->pid;
+    return 0;
+}
+
+/* getproc - Find a job process (by PID) in the PID hash */
+struct proc_t *getproc(struct joblist_t *jobs, pid_t pid) {
+    struct proc_t *proc;
+
+    if (pid < 1)
+        return NULL;
+    for (proc = jobs->bypid[pidhash(jobs, pid)]; proc != NULL; proc = proc->hnext)
+        if (proc->pid == pid)
+            return proc;
+    return NULL;
+}
+
+/* getjobpid  - Find a job (by the PID of any of its processes) on the job list */
+struct job_t *getjobpid(struct joblist_t *jobs, pid_t pid) {
+    struct proc_t *proc = getproc(jobs, pid);
+
+    return proc != NULL ? proc->job : NULL;
+}
+
+/* getjobjid  - Find a job (by JID) on the job list */
+struct job_t *getjobjid(struct joblist_t *jobs, int jid) 
+{
+    if (jid < 1 || jid > jobs->maxjobs)
+        return NULL;
+    return jobs->byjid[jid - 1];
+}
+
+/* pid2jid - Map process ID to job ID */
+int pid2jid(pid_t pid) {
+    struct job_t *job = getjobpid(&jobs, pid);
+
+    return job != NULL ? job->jid : 0;
+}
+
+/* listjobs - Print the job list (with each job's resource usage if usage is set) */
+void listjobs(struct joblist_t *jobs, int usage) {
+    int i;
+    
+    for (i = 0; i < jobs->maxjobs; i++) {
+        struct job_t *job = jobs->byjid[i];
+        if (job != NULL) {
+            printf("[%d] (%d) ", job->jid, job->pid);
+            switch (job->state) {
+                case BG: 
+                    printf("Running ");
+                    break;
+                case FG: 
+                    printf("Foreground ");
+                    break;
+                case ST: 
+                    printf("Stopped ");
+                    break;
+                default:
+                    printf("listjobs: Internal error: job[%d].state=%d ", 
+                       job->jid, job->state);
+            }
+            printf("%s", job->cmdline);
+            if (usage) {
+                struct rusage ru;
+                struct timespec wall;
+                cpu_set_t cpus;
+                char buf[MAXLINE];
+                int j;
+                jobusage(job, &ru, &wall);
+                printf("    %s", fmtusage(&ru, &wall));
+                // the current affinity of a live process (it may have been
+                // changed since), else what the job was started with
+                for (j = 0; j < job->nprocs; j++)
+                    if (job->procs[j].state != PS_DONE && sched_getaffinity(job->procs[j].pid, sizeof(cpus), &cpus) == 0)
+                        break;
+                if (j == job->nprocs && job->place.setcpus)
+                    cpus = job->place.cpus;
+                else if (j == job->nprocs)
+                    sched_getaffinity(0, sizeof(cpus), &cpus);
+                printf("    cpus %s", fmtcpus(&cpus, buf));
+                if (job->place.node >= 0)
+                    printf(" mem-node %d\n", job->place.node);
+                else
+                    printf(" mem-node any\n");
+                if (job->limits.set != 0) {
+                    printf("    limits");
+                    for (j = 0; j < NLIMITS; j++) {
+                        struct rlimit *rl = &job->limits.rl[j];
+                        if (!(job->limits.set & (1u << j)))
+                            continue;
+                        printf(" %s=%s", limitinfo[j].name, fmtlimit(rl->rlim_cur, j, buf));
+                        if (rl->rlim_max != rl->rlim_cur)
+                            printf("/%s", fmtlimit(rl->rlim_max, j, buf));
+                    }
+                    printf("\n");
+                }
+                if (job->cgfd != -1)
+                    printf("    %s", fmtcgroup(job));
+            }
+        }
+    }
+}
+
+/*
+ * reapproc - Reap a job process whose pidfd epoll reported as readable
+ *    (i.e. which has terminated) and queue its exit status and rusage.
+ *    With the queue full it is left for the next wakeup.
+ */
+void reapproc(struct proc_t *proc) {
+    struct rusage ru;
+    int status;
+
+    if (proc == NULL || proc->state == PS_DONE || evq.n == MAXQUEUED)
+        return;
+    // a zombie keeps its PID, so wait4 cannot reap anything but this process
+    if (wait4(proc->pid, &status, WNOHANG, &ru) <= 0)
+        return;
+    pushevent(proc->pid, status, &ru);
+}
+
+/* waitstatus - Encode a child state change reported by waitid as a wait status */
+int waitstatus(siginfo_t *info) {
+    switch (info->si_code) {
+        case CLD_EXITED:
+            return W_EXITCODE(info->si_status, 0);
+        case CLD_STOPPED:
+        case CLD_TRAPPED:
+            return W_STOPCODE(info->si_status);
+        case CLD_DUMPED:
+            return W_EXITCODE(0, info->si_status) | WCOREFLAG;
+        default:
+            return W_EXITCODE(0, info->si_status);
+    }
+}
+
+/*
+ * pushevent - Queue a collected child state change (with the rusage of
+ *    a terminated child, NULL for a stop). The collectors only call it
+ *    when the queue has room, so events are never applied from here.
+ */
+void pushevent(pid_t pid, int status, struct rusage *ru) {
+    struct event_t *ev = &evq.events[evq.n++];
+
+    ev->pid = pid;
+    ev->status = status;
+    if (ru != NULL)
+        ev->ru = *ru;
+    else
+        memset(&ev->ru, 0, sizeof(ev->ru));
+    clock_gettime(CLOCK_MONOTONIC, &ev->time);
+}
+
+/*
+ * applyevents - Apply every queued child event to the job list, then
+ *    print the resulting job messages with a single write
+ */
+void applyevents(void) {
+    struct event_t *ev;
+    struct proc_t *proc;
+    int i;
+
+    for (i = 0; i < evq.n; i++) {
+        ev = &evq.events[i];
+        if ((proc = getproc(&jobs, ev->pid)) == NULL || proc->state == PS_DONE)
+            continue;
+        proc->changed = ev->time;
+        if (WIFSTOPPED(ev->status))
+            stopproc(proc, ev->status);
+        else
+            finishproc(proc, ev->status, &ev->ru);
+    }
+    evq.n = 0;
+    flushreports();
+}
+
+/*
+ * stopproc - Record that a job process was stopped (status is its wait
+ *    status); the job is reported stopped once all of its live processes are
+ */
+void stopproc(struct proc_t *proc, int status) {
+    struct job_t *job;
+    int i;
+
+    proc->state = PS_STOPPED;
+    proc->status = status;
+    job = proc->job;
+    for (i = 0; i < job->nprocs; i++)
+        if (job->procs[i].state == PS_RUNNING)
+            return;
+    if (job->state != ST) {
+        report("Job [%d] (%d) stopped by signal %d\n", job->jid, job->pid, WSTOPSIG(status));
+        job->state = ST;
+        if (job->item > 0) {
+            par.stopped++;
+            par.halted = 1;
+        }
+        // freeze what is left in its cgroup, e.g. processes that ignore SIGTSTP
+        if (job->cgfd != -1)
+            cgwrite(job->cgfd, "cgroup.freeze", "1");
+    }
+}
+
+/*
+ * finishproc - Record the wait status and rusage of a reaped job process. When the
+ *    last one is gone, report the job by the status of its final pipeline
+ *    stage (and any stage killed for exceeding a resource limit) and
+ *    delete it.
+ */
+void finishproc(struct proc_t *proc, int status, struct rusage *ru) {
+    struct job_t *job;
+    const char *why;
+    int i;
+
+    proc->state = PS_DONE;
+    proc->status = status;
+    proc->ru = *ru;
+    if (proc->pidfd != -1)
+        close(proc->pidfd);  /* also drops it from the epoll set */
+    else
+        jobs.unwatched--;
+    proc->pidfd = -1;
+
+    job = proc->job;
+    if (--job->nlive > 0) {
+        // the job may now consist of stopped processes only
+        struct proc_t *live = job->procs;
+        while (live->state == PS_DONE)
+            live++;
+        if (live->state == PS_STOPPED)
+            stopproc(live, live->status);
+        return;
+    }
+    // a stage killed for exceeding a resource limit is always reported
+    for (i = 0; i < job->nprocs - 1; i++)
+        if ((why = limitkill(job, &job->procs[i])) != NULL)
+            report("Job [%d] (%d) stage %d (%d) terminated by signal %d (%s)\n", job->jid, job->pid,
+                   i + 1, job->procs[i].pid, WTERMSIG(job->procs[i].status), why);
+    status = job->procs[job->nprocs - 1].status;
+    if (WIFEXITED(status)) {  // If the last stage terminated naturally
+        if (verbose) report("finishproc: Job [%d] (%d) deleted\n", job->jid, job->pid);
+        if (verbose) report("finishproc: Job [%d] (%d) terminates OK (status %d)\n", job->jid, job->pid, WEXITSTATUS(status));
+    } else {
+        if (verbose) report("finishproc: Job [%d] (%d) deleted\n", job->jid, job->pid);
+        if ((why = limitkill(job, &job->procs[job->nprocs - 1])) != NULL)
+            report("Job [%d] (%d) terminated by signal %d (%s)\n", job->jid, job->pid, WTERMSIG(status), why);
+        else
+            report("Job [%d] (%d) terminated by signal %d\n", job->jid, job->pid, WTERMSIG(status));
+        // a killed job takes down whatever it left behind in its cgroup
+        if (job->cgfd != -1 && cgwrite(job->cgfd, "cgroup.kill", "1") < 0)
+            signalescapees(job, SIGKILL);  // before Linux 5.14
+    }
+    if (job->timed >= 0)
+        reportusage(job);
+    int item = job->item;
+    if (item > 0) {  // report the parallel item's result
+        if (job->state == ST)  // killed while stopped
+            par.stopped--;
+        if (WIFEXITED(status))
+            report("[%d/%d] (%d) Exit %d %s", item, par.nitems, job->pid, WEXITSTATUS(status), job->cmdline);
+        else
+            report("[%d/%d] (%d) Signal %d %s", item, par.nitems, job->pid, WTERMSIG(status), job->cmdline);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            par.failed++;
+        par.running--;
+    }
+    deletejob(&jobs, job->pid);
+    // a parallel slot has just freed up (and the items that cannot be
+    // started must not keep it)
+    if (item > 0)
+        while (!par.halted && par.next < par.nitems && par.running < par.maxjobs)
+            startitem();
+}
+
+/* report - Add a job message to the current batch */
+void report(const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(&msgs.buf[msgs.len], MSGSIZE - msgs.len, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return;
+    if ((size_t)n < MSGSIZE - msgs.len) {
+        msgs.len += n;
+        return;
+    }
+    // it did not fit: make room, and print it directly if it never will
+    flushreports();
+    va_start(ap, fmt);
+    if (n < MSGSIZE)
+        msgs.len = vsnprintf(msgs.buf, MSGSIZE, fmt, ap);
+    else
+        vprintf(fmt, ap);
+    va_end(ap);
+}
 
-        sigsuspend(&mask);
+/* flushreports - Print the job messages of the current batch at once
+ *    (in script mode they just join the stdout buffer) */
+void flushreports(void) {
+    if (msgs.len == 0)
+        return;
+    fwrite(msgs.buf, 1, msgs.len, stdout);
+    if (!script)
+        fflush(stdout);
+    msgs.len = 0;
+}
 
-    }
-    if (verbose) printf("waitfg: Process (%d) no longer the fg process\n", pid);
-    return;
+/*
+ * signaljob - Send sig to every process in the job's process group through
+ *    the pidfd of its first process, so a recycled PID can never be hit.
+ *    Falls back to kill() once that process is gone, or on kernels without
+ *    PIDFD_SIGNAL_PROCESS_GROUP. The processes of its cgroup that left the
+ *    group get sig too.
+ */
+int signaljob(struct job_t *job, int sig) {
+    if (job == NULL)
+        return -1;
+    if (job->cgfd != -1)
+        signalescapees(job, sig);
+    if (job->procs[0].pidfd != -1
+          && pidfd_send_signal(job->procs[0].pidfd, sig, NULL, PIDFD_SIGNAL_PROCESS_GROUP) == 0)
+        return 0;
+    return kill(-(job->pgid), sig);
 }
 
+/* resumejob - Continue a job's processes and put the job in state FG or BG */
+void resumejob(struct job_t *job, int state) {
+    int i;
 
-/*****************
- * Signal handlers
- *****************/
+    for (i = 0; i < job->nprocs; i++)
+        if (job->procs[i].state == PS_STOPPED)
+            job->procs[i].state = PS_RUNNING;
+    if (job->state == ST && job->item > 0)
+        par.stopped--;
+    job->state = state;
+    if (state == FG)
+        jobs.fg = job;
+    if (job->cgfd != -1)
+        cgwrite(job->cgfd, "cgroup.freeze", "0");
+    signaljob(job, SIGCONT);
+}
+/******************************
+ * end job list helper routines
+ ******************************/
 
-/* 
- * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
- *     a child job terminates (becomes a zombie), or stops because it
- *     received a SIGSTOP or SIGTSTP signal. The handler reaps all
- *     available zombie children, but doesn't wait for any other
- *     currently running children to terminate.  
- */
-void sigchld_handler(int sig) {
-    if (verbose) printf("sigchld_handler: entering\n");
 
-    pid_t job_pid;
-    int status;
+/*****************************
+ * Resource accounting helpers
+ *****************************/
 
+/*
+ * addusage - Add ru to sum. Max RSS is summed too: the stages of a
+ *    pipeline run at the same time, so together they hold that much.
+ */
+void addusage(struct rusage *sum, struct rusage *ru) {
+    timeradd(&sum->ru_utime, &ru->ru_utime, &sum->ru_utime);
+    timeradd(&sum->ru_stime, &ru->ru_stime, &sum->ru_stime);
+    sum->ru_maxrss += ru->ru_maxrss;
+    sum->ru_minflt += ru->ru_minflt;
+    sum->ru_majflt += ru->ru_majflt;
+    sum->ru_nvcsw += ru->ru_nvcsw;
+    sum->ru_nivcsw += ru->ru_nivcsw;
+}
 
-    while((job_pid = waitpid(-1, &status, WNOHANG | WUNTRACED)) > 0){
-        struct job_t *job = getjobpid(jobs, job_pid);
-        if(WIFEXITED(status)){  // If SIGCHLD was received because the child terminated natrually
-            if (verbose) printf("sigchld_handler: Job [%d] (%d) deleted\n", pid2jid(job_pid), job_pid);
-            if (verbose) printf("sigchld_handler: Job [%d] (%d) terminates OK (status %d)\n", pid2jid(job_pid), job_pid, WEXITSTATUS(status));
-            deletejob(jobs, job_pid);
-        }
-        else if(WIFSIGNALED(status)){
-            if (verbose) printf("sigchld_handler: Job [%d] (%d) deleted\n", pid2jid(job_pid), job_pid);
-            printf("Job [%d] (%d) terminated by signal %d\n", pid2jid(job_pid), job_pid, WTERMSIG(status));
-            deletejob(jobs, job_pid);
-        }
-        else if(WIFSTOPPED(status)){
-            printf("Job [%d] (%d) stopped by signal %d\n", pid2jid(job_pid), job_pid, WSTOPSIG(status));
-            job->state = ST;
-        }
-    }
+/*
+ * procusage - Sample the resource usage of a process that has not been
+ *    reaped yet from /proc/<pid>/stat and /proc/<pid>/status.
+ *    Returns 0 (leaving ru zeroed) if the process cannot be read.
+ */
+int procusage(pid_t pid, struct rusage *ru) {
+    char path[64], buf[MAXLINE], *p;
+    unsigned long minflt, majflt, utime, stime;
+    long hz = sysconf(_SC_CLK_TCK);
+    FILE *fp;
+    int n;
 
-    if(job_pid == -1 && errno != ECHILD){
-        perror("waitpid");
-    }
+    memset(ru, 0, sizeof(*ru));
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    if ((fp = fopen(path, "r")) == NULL)
+        return 0;
+    n = fread(buf, 1, sizeof(buf) - 1, fp);
+    fclose(fp);
+    buf[n] = '\0';
+    // skip "pid (comm) " (comm may contain spaces), then fields 3..15
+    if ((p = strrchr(buf, ')')) == NULL
+          || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %lu %*u %lu %*u %lu %lu",
+                    &minflt, &majflt, &utime, &stime) != 4)
+        return 0;
+    ru->ru_minflt = minflt;
+    ru->ru_majflt = majflt;
+    ru->ru_utime.tv_sec = utime / hz;
+    ru->ru_utime.tv_usec = (utime % hz) * 1000000 / hz;
+    ru->ru_stime.tv_sec = stime / hz;
+    ru->ru_stime.tv_usec = (stime % hz) * 1000000 / hz;
 
-    if (verbose) printf("sigchld_handler: exiting\n");
-    return;
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    if ((fp = fopen(path, "r")) == NULL)
+        return 1;
+    while (fgets(buf, sizeof(buf), fp) != NULL) {
+        sscanf(buf, "VmHWM: %ld", &ru->ru_maxrss);
+        sscanf(buf, "voluntary_ctxt_switches: %ld", &ru->ru_nvcsw);
+        sscanf(buf, "nonvoluntary_ctxt_switches: %ld", &ru->ru_nivcsw);
+    }
+    fclose(fp);
+    return 1;
 }
 
-/* 
- * sigint_handler - The kernel sends a SIGINT to the shell whenever the
- *    user types ctrl-c at the keyboard.  Catch it and send it along
- *    to the foreground job.  
+/*
+ * jobusage - Sum the resource usage of all of a job's processes (from
+ *    wait4 for the reaped ones, sampled for the others) into ru, and store
+ *    the job's wall time so far (until its last exit once all are reaped)
  */
-void sigint_handler(int sig) {
-    if (verbose) printf("sigint_handler: entering\n");
-    //Get job pid of the foreground job from Jobs
-    pid_t job_pid = fgpid(jobs);
-    //If their is a job in the foreground then we kill the job
-    if(job_pid != 0){
-        if (verbose) printf("sigint_handler: Job [%d] (%d) killed\n", pid2jid(job_pid), job_pid);
-        int return_val = kill(-job_pid, SIGINT);
-        //error check in case process could not be killed
-        if(return_val == -1){
-            fprintf(stderr, "SIGINT Error: Job Could not be killed");
+void jobusage(struct job_t *job, struct rusage *ru, struct timespec *wall) {
+    struct rusage live;
+    struct timespec end = job->start;
+    int i;
+
+    memset(ru, 0, sizeof(*ru));
+    for (i = 0; i < job->nprocs; i++) {
+        struct proc_t *proc = &job->procs[i];
+        if (proc->state == PS_DONE) {
+            addusage(ru, &proc->ru);
+            if (proc->changed.tv_sec > end.tv_sec
+                  || (proc->changed.tv_sec == end.tv_sec && proc->changed.tv_nsec > end.tv_nsec))
+                end = proc->changed;
+        } else if (procusage(proc->pid, &live)) {
+            addusage(ru, &live);
         }
     }
-    if (verbose) printf("sigint_handler: exiting\n");
-    return;
+    if (job->nlive > 0)
+        clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed(&job->start, &end, wall);
 }
 
 /*
- * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
- *     the user types ctrl-z at the keyboard. Catch it and suspend the
- *     foreground job by sending it a SIGTSTP.  
+ * reportusage - Report the resource usage of a timed job that has just
+ *    exited, with one line per stage for a pipeline, if it ran for at
+ *    least job->timed ms
  */
-void sigtstp_handler(int sig) {
-    if (verbose) printf("sigtstp_handler: entering\n");
+void reportusage(struct job_t *job) {
+    struct rusage ru;
+    struct timespec wall;
+    int i;
 
-    //Get job pid of the foreground jov
-    pid_t job_pid = fgpid(jobs);
+    jobusage(job, &ru, &wall);
+    if (wall.tv_sec * 1000L + wall.tv_nsec / 1000000L < job->timed)
+        return;
+    report("Job [%d] (%d) %s", job->jid, job->pid, fmtusage(&ru, &wall));
+    if (job->cgfd != -1)
+        report("    %s", fmtcgroup(job));
+    if (job->nprocs == 1)
+        return;
+    for (i = 0; i < job->nprocs; i++) {
+        struct proc_t *proc = &job->procs[i];
+        elapsed(&job->start, &proc->changed, &wall);
+        report("    stage %d (%d) %s", i + 1, proc->pid, fmtusage(&proc->ru, &wall));
+    }
+}
 
-    //If their is a job in the foreground then we stop the job
-    if(job_pid != 0){
-        if (verbose) printf("sigtstp_handler: Job [%d] (%d) stopped\n", pid2jid(job_pid), job_pid);
+/* elapsed - Store the time from from to to in d */
+void elapsed(struct timespec *from, struct timespec *to, struct timespec *d) {
+    d->tv_sec = to->tv_sec - from->tv_sec;
+    d->tv_nsec = to->tv_nsec - from->tv_nsec;
+    if (d->tv_nsec < 0) {
+        d->tv_sec--;
+        d->tv_nsec += 1000000000L;
+    }
+}
 
-        int return_val = kill(-job_pid, SIGTSTP);
+/* fmtusage - Format a resource usage summary line in sbuf */
+char *fmtusage(struct rusage *ru, struct timespec *wall) {
+    sprintf(sbuf, "real %ld.%03lds user %ld.%03lds sys %ld.%03lds maxrss %ldKB"
+           " faults %ld/%ld csw %ld/%ld\n",
+           (long)wall->tv_sec, wall->tv_nsec / 1000000L,
+           (long)ru->ru_utime.tv_sec, (long)ru->ru_utime.tv_usec / 1000,
+           (long)ru->ru_stime.tv_sec, (long)ru->ru_stime.tv_usec / 1000,
+           ru->ru_maxrss, ru->ru_minflt, ru->ru_majflt, ru->ru_nvcsw, ru->ru_nivcsw);
+    return sbuf;
+}
 
-        if(return_val == -1){
-            fprintf(stderr, "SIGTSTOP Error: Job Could not be killed.");
+
+/****************
+ * cgroup helpers
+ ****************/
+
+/*
+ * initcgroup - Make the cgroup "tsh-PID" inside our own cgroup v2, to
+ *    hold the cgroups of the jobs run with --cgroup, unless that was done
+ *    already. Returns 0, or -1 (saying why) if there is no cgroup2 mount
+ *    or our cgroup was not delegated to us.
+ */
+int initcgroup(void) {
+    char buf[MAXLINE], mnt[MAXLINE] = "", path[MAXLINE] = "";
+    struct dirent *d;
+    DIR *dir;
+    FILE *fp;
+    pid_t pid;
+    int fd;
+
+    if (cgroot != -1)
+        return 0;
+    // the mount point is field 5 of "id parent dev root mnt opts ... - cgroup2 ..."
+    if ((fp = fopen("/proc/self/mountinfo", "r")) != NULL) {
+        while (fgets(buf, sizeof(buf), fp) != NULL)
+            if (strstr(buf, " - cgroup2 ") != NULL && sscanf(buf, "%*s %*s %*s %*s %s", mnt) == 1)
+                break;
+        fclose(fp);
+    }
+    // and our cgroup is the "0::/path" line of the unified hierarchy
+    if ((fp = fopen("/proc/self/cgroup", "r")) != NULL) {
+        while (fgets(buf, sizeof(buf), fp) != NULL)
+            if (strncmp(buf, "0::", 3) == 0 && sscanf(buf + 3, "%s", path) == 1)
+                break;
+        fclose(fp);
+    }
+    if (mnt[0] == '\0' || path[0] == '\0') {
+        printf("run: --cgroup: no cgroup v2 hierarchy\n");
+        return -1;
+    }
+    snprintf(buf, sizeof(buf), "%s%s", mnt, path);
+    sprintf(cgname, "tsh-%d", (int)getpid());
+    // moving a process between two cgroups takes write access to the
+    // cgroup.procs of both and of their common ancestor
+    if ((cgparent = open(buf, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1
+          || faccessat(cgparent, "cgroup.procs", W_OK, 0) == -1
+          || mkdirat(cgparent, cgname, 0755) == -1) {
+        printf("run: --cgroup: %s: %s\n", buf, strerror(errno));
+        if (cgparent != -1)
+            close(cgparent);
+        cgparent = -1;
+        return -1;
+    }
+    if ((cgroot = openat(cgparent, cgname, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+        printf("run: --cgroup: %s/%s: %s\n", buf, cgname, strerror(errno));
+        unlinkat(cgparent, cgname, AT_REMOVEDIR);
+        close(cgparent);
+        cgparent = -1;
+        return -1;
+    }
+    cgowner = getpid();
+    atexit(exitcgroup);
+    // and those of shells that have exited since, once they are empty
+    if ((fd = dup(cgparent)) != -1) {
+        if ((dir = fdopendir(fd)) != NULL) {
+            while ((d = readdir(dir)) != NULL)
+                if (sscanf(d->d_name, "tsh-%d", &pid) == 1 && kill(pid, 0) == -1 && errno == ESRCH)
+                    prunecgroup(cgparent, d->d_name);
+            closedir(dir);
+        } else {
+            close(fd);
         }
     }
-    if (verbose) printf("sigtstp_handler: exiting\n");
-    return;
+    // for memory.peak: fails (harmlessly) where the memory controller is
+    // not ours to hand down, e.g. still mounted as cgroup v1
+    cgwrite(cgroot, "cgroup.subtree_control", "+memory");
+    if (verbose) printf("initcgroup: jobs run in %s/%s\n", buf, cgname);
+    return 0;
 }
 
 /*
- * sigusr1_handler - child is ready
+ * exitcgroup - Remove the cgroups made by initcgroup, at exit. The ones
+ *    still holding processes (of jobs left running or stopped) cannot be
+ *    removed and stay behind, for the next shell to remove.
  */
-void sigusr1_handler(int sig) {
-    if (verbose) printf("sigusr1_handler: entering\n");
-    ready = 1;
-    if (verbose) printf("sigusr1_handler: exiting\n");
+void exitcgroup(void) {
+    // forked children exit through here too, but the cgroups are not theirs
+    if (cgroot == -1 || getpid() != cgowner)
+        return;
+    close(cgroot);
+    cgroot = -1;
+    prunecgroup(cgparent, cgname);
 }
 
+/*
+ * prunecgroup - Remove the cgroup name in parent and the (empty) job
+ *    cgroups in it, thawing any that are frozen
+ */
+void prunecgroup(int parent, const char *name) {
+    char path[MAXLINE];
+    struct dirent *d;
+    DIR *dir;
+    int fd;
 
-/*********************
- * End signal handlers
- *********************/
+    if ((fd = openat(parent, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+        return;
+    if ((dir = fdopendir(fd)) == NULL) {
+        close(fd);
+        return;
+    }
+    while ((d = readdir(dir)) != NULL) {
+        if (strncmp(d->d_name, "job", 3) != 0)
+            continue;
+        // a stopped job would miss the SIGHUP and SIGCONT the kernel sends
+        // it once we are gone
+        snprintf(path, sizeof(path), "%s/cgroup.freeze", d->d_name);
+        cgwrite(fd, path, "0");
+        unlinkat(fd, d->d_name, AT_REMOVEDIR);
+    }
+    closedir(dir);
+    unlinkat(parent, name, AT_REMOVEDIR);
+}
 
-/***********************************************
- * Helper routines that manipulate the job list
- **********************************************/
+/*
+ * cgwrite - Write text to the file of the cgroup directory dirfd.
+ *    Async-signal-safe, for use in a forked child.
+ */
+int cgwrite(int dirfd, const char *file, const char *text) {
+    int fd, rc;
 
-/* clearjob - Clear the entries in a job struct */
-void clearjob(struct job_t *job) {
-    job->pid = 0;
-    job->jid = 0;
-    job->state = UNDEF;
-    job->cmdline[0] = '\0';
+    if ((fd = openat(dirfd, file, O_WRONLY | O_CLOEXEC)) == -1)
+        return -1;
+    rc = write(fd, text, strlen(text));
+    close(fd);
+    return rc < 0 ? -1 : 0;
 }
 
-/* initjobs - Initialize the job list */
-void initjobs(struct job_t *jobs) {
-    int i;
+/*
+ * newcgroup - Make the cgroup of a new job and store its number in id.
+ *    Returns its directory, or -1 if jobs get no cgroup.
+ */
+int newcgroup(int *id) {
+    char name[32];
+    int fd;
 
-    for (i = 0; i < MAXJOBS; i++)
-        clearjob(&jobs[i]);
+    if (cgroot == -1)
+        return -1;
+    *id = ++cgseq;
+    sprintf(name, "job%d", *id);
+    if (mkdirat(cgroot, name, 0755) == -1) {
+        if (verbose) printf("newcgroup: %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+    if ((fd = openat(cgroot, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+        unlinkat(cgroot, name, AT_REMOVEDIR);
+    return fd;
 }
 
-/* freejid - Returns smallest free job ID */
-int freejid(struct job_t *jobs) {
-    int i;
-    int taken[MAXJOBS + 1] = {0};
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].jid != 0) 
-        taken[jobs[i].jid] = 1;
-    for (i = 1; i <= MAXJOBS; i++)
-        if (!taken[i])
-            return i;
-    return 0;
+/*
+ * dropcgroup - Close and remove the cgroup of a job. If a process that
+ *    left the job is still in it, it stays until exitcgroup.
+ */
+void dropcgroup(int fd, int id) {
+    char name[32];
+
+    close(fd);
+    sprintf(name, "job%d", id);
+    if (unlinkat(cgroot, name, AT_REMOVEDIR) == -1 && verbose)
+        printf("dropcgroup: %s: %s\n", name, strerror(errno));
 }
 
-/* addjob - Add a job to the job list */
-int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline) {
-    int i;
-    
-    if (pid < 1)
-        return 0;
-    int free = freejid(jobs);
-    if (!free) {
-        printf("Tried to create too many jobs\n");
-        return 0;
-    }
-    for (i = 0; i < MAXJOBS; i++) {
-        if (jobs[i].pid == 0) {
-            jobs[i].pid = pid;
-            jobs[i].state = state;
-            jobs[i].jid = free;
-            strcpy(jobs[i].cmdline, cmdline);
-            if(verbose){
-                printf("Added job [%d] %d %s\n", jobs[i].jid, jobs[i].pid, jobs[i].cmdline);
-            }
-            return 1;
-        }
+/*
+ * signalescapees - Send sig to the processes of a job's cgroup that are
+ *    no longer in its process group (e.g. ones that called setsid), which
+ *    a signal to the group misses
+ */
+void signalescapees(struct job_t *job, int sig) {
+    FILE *fp;
+    pid_t pid;
+    int fd;
+
+    if ((fd = openat(job->cgfd, "cgroup.procs", O_RDONLY | O_CLOEXEC)) == -1)
+        return;
+    if ((fp = fdopen(fd, "r")) == NULL) {
+        close(fd);
+        return;
     }
-    return 0; /*suppress compiler warning*/
+    while (fscanf(fp, "%d", &pid) == 1)
+        if (getpgid(pid) != job->pgid)
+            kill(pid, sig);
+    fclose(fp);
 }
 
-/* deletejob - Delete a job whose PID=pid from the job list */
-int deletejob(struct job_t *jobs, pid_t pid) {
-    int i;
-
-    if (pid < 1)
-        return 0;
+/*
+ * fmtcgroup - Format the CPU time of a job's cgroup from its cpu.stat
+ *    (which counts every process ever in it, whether waited for or not),
+ *    and its memory.peak if it has one, in sbuf
+ */
+char *fmtcgroup(struct job_t *job) {
+    char buf[MAXLINE];
+    long long user = 0, sys = 0, peak = -1;
+    FILE *fp;
+    int fd;
 
-    for (i = 0; i < MAXJOBS; i++) {
-        if (jobs[i].pid == pid) {
-            clearjob(&jobs[i]);
-            return 1;
+    if ((fd = openat(job->cgfd, "cpu.stat", O_RDONLY | O_CLOEXEC)) != -1) {
+        if ((fp = fdopen(fd, "r")) != NULL) {
+            while (fgets(buf, sizeof(buf), fp) != NULL) {
+                sscanf(buf, "user_usec %lld", &user);
+                sscanf(buf, "system_usec %lld", &sys);
+            }
+            fclose(fp);
+        } else {
+            close(fd);
         }
     }
-    return 0;
+    if ((fd = openat(job->cgfd, "memory.peak", O_RDONLY | O_CLOEXEC)) != -1) {
+        if ((fp = fdopen(fd, "r")) != NULL) {
+            if (fscanf(fp, "%lld", &peak) != 1)
+                peak = -1;
+            fclose(fp);
+        } else {
+            close(fd);
+        }
+    }
+    sprintf(sbuf, "cgroup job%d: user %lld.%03llds sys %lld.%03llds",
+            job->cgid, user / 1000000, user / 1000 % 1000, sys / 1000000, sys / 1000 % 1000);
+    if (peak >= 0)
+        sprintf(sbuf + strlen(sbuf), " memory.peak %lldKB", peak / 1024);
+    strcat(sbuf, "\n");
+    return sbuf;
 }
 
-/* fgpid - Return PID of current foreground job, 0 if no such job */
-pid_t fgpid(struct job_t *jobs) {
+/*************************
+ * Resource limit helpers
+ *************************/
+
+/*
+ * findlimit - Find the limit with ulimit option opt, or if name is not
+ *    NULL the one called by the len bytes of name. Returns its index in
+ *    limitinfo, or -1 if there is none.
+ */
+int findlimit(char opt, const char *name, size_t len) {
     int i;
 
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].state == FG)
-            return jobs[i].pid;
-    return 0;
+    for (i = 0; i < NLIMITS; i++)
+        if (name == NULL ? limitinfo[i].opt == opt
+              : strlen(limitinfo[i].name) == len && strncmp(limitinfo[i].name, name, len) == 0)
+            return i;
+    return -1;
 }
 
-/* getjobpid  - Find a job (by PID) on the job list */
-struct job_t *getjobpid(struct job_t *jobs, pid_t pid) {
-    int i;
+/*
+ * parselimit - Parse a value of limit i (a number of its units, or
+ *    "unlimited") into v. Returns 0, or -1 if it is not one.
+ */
+int parselimit(const char *s, int i, rlim_t *v) {
+    unsigned long long n;
+    char *end;
 
-    if (pid < 1)
-        return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].pid == pid)
-            return &jobs[i];
-    return NULL;
+    if (strcmp(s, "unlimited") == 0) {
+        *v = RLIM_INFINITY;
+        return 0;
+    }
+    if (!isdigit((unsigned char)*s))
+        return -1;
+    errno = 0;
+    n = strtoull(s, &end, 10);
+    if (*end != '\0' || errno != 0 || n >= RLIM_INFINITY / limitinfo[i].unit)
+        return -1;
+    *v = n * limitinfo[i].unit;
+    return 0;
 }
 
-/* getjobjid  - Find a job (by JID) on the job list */
-struct job_t *getjobjid(struct job_t *jobs, int jid) 
-{
-    int i;
+/* fmtlimit - Format a value of limit i in its units in buf */
+char *fmtlimit(rlim_t v, int i, char *buf) {
+    if (v == RLIM_INFINITY)
+        strcpy(buf, "unlimited");
+    else
+        sprintf(buf, "%llu", (unsigned long long)(v / limitinfo[i].unit));
+    return buf;
+}
 
-    if (jid < 1)
-        return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].jid == jid)
-            return &jobs[i];
-    return NULL;
+/*
+ * getlimit - Store limit i of limits in rl: the one set there, else the
+ *    shell's own (which its children inherit)
+ */
+void getlimit(struct limits_t *limits, int i, struct rlimit *rl) {
+    if (limits->set & (1u << i))
+        *rl = limits->rl[i];
+    else
+        getrlimit(limitinfo[i].resource, rl);
 }
 
-/* pid2jid - Map process ID to job ID */
-int pid2jid(pid_t pid) {
-    int i;
+/*
+ * setlimit - Set limit i of limits to rl. If that is the shell's own
+ *    limit, it is marked as not set instead: the children inherit it anyway.
+ */
+void setlimit(struct limits_t *limits, int i, struct rlimit *rl) {
+    struct rlimit own;
 
-    if (pid < 1)
-        return 0;
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].pid == pid) {
-            return jobs[i].jid;
+    getrlimit(limitinfo[i].resource, &own);
+    if (rl->rlim_cur == own.rlim_cur && rl->rlim_max == own.rlim_max) {
+        limits->set &= ~(1u << i);
+        return;
     }
-    return 0;
+    limits->rl[i] = *rl;
+    limits->set |= 1u << i;
 }
 
-/* listjobs - Print the job list */
-void listjobs(struct job_t *jobs) {
+/*
+ * applylimits - Set the resource limits of the calling process (a job's
+ *    child, before it execs) to the ones set in limits
+ */
+void applylimits(struct limits_t *limits) {
     int i;
-    
-    for (i = 0; i < MAXJOBS; i++) {
-        if (jobs[i].pid != 0) {
-            printf("[%d] (%d) ", jobs[i].jid, jobs[i].pid);
-            switch (jobs[i].state) {
-                case BG: 
-                    printf("Running ");
-                    break;
-                case FG: 
-                    printf("Foreground ");
-                    break;
-                case ST: 
-                    printf("Stopped ");
-                    break;
-                default:
-                    printf("listjobs: Internal error: job[%d].state=%d ", 
-                       i, jobs[i].state);
-            }
-            printf("%s", jobs[i].cmdline);
+
+    for (i = 0; i < NLIMITS; i++) {
+        if ((limits->set & (1u << i)) && setrlimit(limitinfo[i].resource, &limits->rl[i]) < 0) {
+            sprintf(sbuf, "setrlimit %s", limitinfo[i].name);
+            perror(sbuf);
         }
     }
 }
-/******************************
- * end job list helper routines
- ******************************/
 
+/*
+ * limitkill - Tell which resource limit the kernel killed proc (done)
+ *    for, or return NULL if it was not killed for one. The soft CPU limit
+ *    sends SIGXCPU and the file size limit SIGXFSZ; the hard CPU limit
+ *    sends SIGKILL, which is told apart from a kill -9 by the CPU time
+ *    the process used.
+ */
+const char *limitkill(struct job_t *job, struct proc_t *proc) {
+    struct rlimit rl;
+    long long used;
+
+    if (!WIFSIGNALED(proc->status))
+        return NULL;
+    switch (WTERMSIG(proc->status)) {
+        case SIGXCPU:
+            return "CPU time limit exceeded";
+        case SIGXFSZ:
+            return "file size limit exceeded";
+        case SIGKILL:
+            getlimit(&job->limits, findlimit('t', NULL, 0), &rl);
+            // rusage rounds, so count the last half second as used
+            used = proc->ru.ru_utime.tv_sec + proc->ru.ru_stime.tv_sec
+                 + (proc->ru.ru_utime.tv_usec + proc->ru.ru_stime.tv_usec + 500000) / 1000000;
+            if (rl.rlim_max != RLIM_INFINITY && used >= (long long)rl.rlim_max)
+                return "CPU time limit exceeded";
+    }
+    return NULL;
+}
 
 /***********************
  * Other helper routines
@@ -830,10 +4392,12 @@ void listjobs(struct job_t *jobs) {
  * usage - print a help message and terminate
  */
 void usage(void) {
-    printf("Usage: shell [-hvp]\n");
+    printf("Usage: shell [-hvps] [file]\n");
     printf("   -h   print this message\n");
     printf("   -v   print additional diagnostic information\n");
     printf("   -p   do not emit a command prompt\n");
+    printf("   -s   always exec echo, printf, test, true and false\n");
+    printf("   file read commands from file (script mode)\n");
     exit(1);
 }
 
@@ -876,3 +4440,120 @@ void sigquit_handler(int sig) {
     printf("Terminating after receipt of SIGQUIT signal\n");
     exit(1);
 }
+
+#ifdef SCANBENCH
+/*
+ * refparse - The parser as it was before the scanner: strchr for the
+ *    delimiters of each word, then strcmp passes over argv for the
+ *    operators (as in eval and parsestages). Kept for the benchmark only.
+ */
+int refparse(char *buf, char **argv) {
+    char *delim;
+    int argc = 0, i, nops = 0;
+
+    buf[strlen(buf)-1] = ' ';
+    while (*buf && (*buf == ' '))
+        buf++;
+    if (*buf == '\'') {
+        buf++;
+        delim = strchr(buf, '\'');
+    }
+    else {
+        delim = strchr(buf, ' ');
+    }
+    while (delim) {
+        argv[argc++] = buf;
+        *delim = '\0';
+        buf = delim + 1;
+        while (*buf && (*buf == ' '))
+            buf++;
+        if (*buf == '\'') {
+            buf++;
+            delim = strchr(buf, '\'');
+        }
+        else {
+            delim = strchr(buf, ' ');
+        }
+    }
+    argv[argc] = NULL;
+    if (argc > 0 && !strcmp(argv[argc - 1], "&"))
+        nops++;
+    for (i = 0; i < argc; i++)
+        if (!strcmp(argv[i], "|") || !strcmp(argv[i], "<") || !strcmp(argv[i], ">"))
+            nops++;
+    for (i = 0; i < argc; i++)
+        if (!strcmp(argv[i], "|") || !strcmp(argv[i], "<") || !strcmp(argv[i], ">"))
+            nops++;
+    return argc + nops;
+}
+
+/*
+ * scanbench - Time the old parser against parseline with each block
+ *    scanner on a generated line: scanbench [words [word length]]
+ */
+int scanbench(int argc, char **argv) {
+    int nwords = (argc > 1) ? atoi(argv[1]) : 100000;
+    int wordlen = (argc > 2) ? atoi(argv[2]) : 8;
+    size_t len = (size_t)nwords * (wordlen + 1) + 2;
+    char *line = malloc(len + 1), *copy = malloc(len + 1);
+    char **refargv = malloc((nwords + 2) * sizeof(char *));
+    struct arena_t arena = { NULL, 0 };
+    struct timespec t0, t1;
+    char **av;
+    unsigned char *kinds;
+    int i, j, reps, n = 0;
+    size_t pos = 0;
+
+    struct { const char *name; void (*blocks)(const char *, size_t, uint64_t *, uint64_t *, uint64_t *); } impls[] = {
+        { "scalar", scanblocks_scalar },
+#ifdef SCAN_X86
+        { "sse2", scanblocks_sse2 },
+        { "avx2", scanblocks_avx2 },
+#endif
+    };
+
+    // words like "/bin/cat", with a "|" every 16 words and a quoted word every 32
+    for (i = 0; i < nwords; i++) {
+        if (i % 16 == 15)
+            pos += sprintf(&line[pos], "| ");
+        else if (i % 32 == 7)
+            pos += sprintf(&line[pos], "'%.*s' ", wordlen - 2, "x x x x x x x x x x x x x x x x");
+        else {
+            for (j = 0; j < wordlen; j++)
+                line[pos++] = 'a' + (i + j) % 26;
+            line[pos++] = ' ';
+        }
+    }
+    line[pos++] = '\n';
+    line[pos] = '\0';
+    reps = (int)(200000000 / (pos + 1)) + 1;
+    printf("line: %zu bytes, %d words, %d reps\n", pos, nwords, reps);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < reps; i++) {
+        memcpy(copy, line, pos + 1);
+        n = refparse(copy, refargv);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("%-8s %8.3f ns/byte (%d)\n", "strchr",
+           ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / reps / pos, n);
+
+    for (j = 0; j < (int)(sizeof(impls) / sizeof(impls[0])); j++) {
+#ifdef SCAN_X86
+        if ((impls[j].blocks == scanblocks_avx2 && !__builtin_cpu_supports("avx2"))
+              || (impls[j].blocks == scanblocks_sse2 && !__builtin_cpu_supports("sse2")))
+            continue;
+#endif
+        scanblocks = impls[j].blocks;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (i = 0; i < reps; i++) {
+            arenareset(&arena);
+            n = parseline(line, &av, &kinds, &arena);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        printf("%-8s %8.3f ns/byte (%d)\n", impls[j].name,
+               ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / reps / pos, n);
+    }
+    return 0;
+}
+#endif